@@ -0,0 +1,156 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "blit.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static void
+swap_scalar(uint32_t *dst, const uint32_t *src, int count)
+{
+	for (int i = 0; i < count; i++)
+		dst[i] = (src[i] & 0xff00ff00) | (src[i] >> 16 & 0xff) | (src[i] & 0xff) << 16;
+}
+
+static void
+scale_scalar(uint32_t *dst, const uint32_t *src, int count, int scale)
+{
+	for (int i = 0; i < count; i++)
+		for (int j = 0; j < scale; j++)
+			*dst++ = src[i];
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2"))) static void
+scale_sse2(uint32_t *dst, const uint32_t *src, int count, int scale)
+{
+	const int total = count * scale, span = (scale + 3) & ~3;
+	int i = 0;
+
+	if (scale == 2) {
+		for (; i + 4 <= count; i += 4) {
+			const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+			_mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi32(v, v));
+			_mm_storeu_si128((__m128i *)(dst + 2 * i + 4), _mm_unpackhi_epi32(v, v));
+		}
+	} else {
+		/* Every pixel is stored in whole vectors, the last of which the next pixel
+		 * partly overwrites */
+		for (; i < count && i * scale + span <= total; i++) {
+			const __m128i v = _mm_set1_epi32(src[i]);
+			for (int j = 0; j < scale; j += 4)
+				_mm_storeu_si128((__m128i *)(dst + i * scale + j), v);
+		}
+	}
+	scale_scalar(dst + i * scale, src + i, count - i, scale);
+}
+
+__attribute__((target("avx2"))) static void
+scale_avx2(uint32_t *dst, const uint32_t *src, int count, int scale)
+{
+	const int total = count * scale, span = (scale + 7) & ~7;
+	int i = 0;
+
+	if (scale == 2) {
+		for (; i + 8 <= count; i += 8) {
+			const __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+			/* Unpacking works within 128-bit lanes, so the halves need regrouping */
+			const __m256i lo = _mm256_unpacklo_epi32(v, v), hi = _mm256_unpackhi_epi32(v, v);
+			_mm256_storeu_si256((__m256i *)(dst + 2 * i),
+					_mm256_permute2x128_si256(lo, hi, 0x20));
+			_mm256_storeu_si256((__m256i *)(dst + 2 * i + 8),
+					_mm256_permute2x128_si256(lo, hi, 0x31));
+		}
+	} else if (scale > 4) {
+		for (; i < count && i * scale + span <= total; i++) {
+			const __m256i v = _mm256_set1_epi32(src[i]);
+			for (int j = 0; j < scale; j += 8)
+				_mm256_storeu_si256((__m256i *)(dst + i * scale + j), v);
+		}
+	}
+	scale_sse2(dst + i * scale, src + i, count - i, scale);
+}
+
+__attribute__((target("avx2"))) static void
+swap_avx2(uint32_t *dst, const uint32_t *src, int count)
+{
+	const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13,
+			12, 15, 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(
+				_mm256_loadu_si256((const __m256i *)(src + i)), shuffle));
+	swap_scalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("ssse3"))) static void
+swap_ssse3(uint32_t *dst, const uint32_t *src, int count)
+{
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13,
+			12, 15);
+	int i;
+
+	for (i = 0; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i *)(src + i)), shuffle));
+	swap_scalar(dst + i, src + i, count - i);
+}
+#endif
+
+void
+blit_row(uint32_t *dst, const uint32_t *src, int count, bool swap)
+{
+	if (!swap)
+		return (void)memcpy(dst, src, count * sizeof *dst);
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return swap_avx2(dst, src, count);
+	if (__builtin_cpu_supports("ssse3"))
+		return swap_ssse3(dst, src, count);
+#endif
+	swap_scalar(dst, src, count);
+}
+
+void
+blit_scale_row(uint32_t *dst, const uint32_t *src, int count, int scale, bool swap)
+{
+	void (*kernel)(uint32_t *dst, const uint32_t *src, int count, int scale) = scale_scalar;
+	uint32_t swapped[256];
+	int n;
+
+	if (scale == 1)
+		return blit_row(dst, src, count, swap);
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		kernel = scale_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		kernel = scale_sse2;
+#endif
+	if (!swap)
+		return kernel(dst, src, count, scale);
+
+	/* Swap a chunk at a time, before it gets repeated */
+	for (; count > 0; count -= n, src += n, dst += n * scale) {
+		n = count < 256 ? count : 256;
+		blit_row(swapped, src, n, true);
+		kernel(dst, swapped, n, scale);
+	}
+}
+
+void
+blit_tile_row(uint32_t *dst, int width, const uint32_t *src, int tile_width, bool swap)
+{
+	int x = tile_width < width ? tile_width : width;
+
+	blit_row(dst, src, x, swap);
+	/* Double the whole tiles copied so far until the row is full */
+	for (; x < width; x *= 2)
+		memcpy(dst + x, dst, (x < width - x ? x : width - x) * sizeof *dst);
+}
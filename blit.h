@@ -0,0 +1,15 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Copies count 32-bit pixels from src to dst, swapping red and blue if swap is set */
+void blit_row(uint32_t *dst, const uint32_t *src, int count, bool swap);
+/* Copies count pixels from src to dst, repeating each one scale times */
+void blit_scale_row(uint32_t *dst, const uint32_t *src, int count, int scale, bool swap);
+/* Fills width pixels of dst by repeating the tile_width pixels of src, starting with the
+ * first one. Only the first tile is read from src, the rest is copied within dst. */
+void blit_tile_row(uint32_t *dst, int width, const uint32_t *src, int tile_width, bool swap);
+
+#endif /* BLIT_H */
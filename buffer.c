@@ -1,72 +1,441 @@
+#define _GNU_SOURCE /* memfd_create, F_ADD_SEALS */
+#include <errno.h>
 #include <fcntl.h>
 #include <pixman.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
+#include "buffer.h"
+#include "log.h"
+
+static void
+randname(char *buf)
+{
+	struct timespec ts;
+	long r;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r = ts.tv_nsec ^ (long)getpid() << 16;
+	for (int i = 0; i < 6; i++, r >>= 5)
+		buf[i] = 'A' + (r & 15) + (r & 16) * 2;
+}
+
 static int
-allocate_shm_file(size_t size)
+create_shm_file(void)
+{
+	char name[] = "/jab-shm-XXXXXX";
+	int fd, retries = 100;
+
+	do {
+		randname(name + sizeof name - 7);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0) {
+			shm_unlink(name);
+			return fd;
+		}
+	} while (--retries > 0 && errno == EEXIST);
+
+	return -1;
+}
+
+static int
+allocate_shm_file(size_t size, const char **kind)
 {
-	char name[] = "/jab-shm-buffer";
 	int fd;
 
-	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
-	if (fd == -1 || ftruncate(fd, size) == -1)
-		return -1;
+#ifdef MFD_CLOEXEC
+	/* Anonymous memory needs no name in /dev/shm and cannot collide with other instances.
+	 * The size never changes after this, so seal it to let the compositor skip SIGBUS
+	 * handling. */
+	fd = memfd_create("jab-shm-buffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		if (ftruncate(fd, size) == -1) {
+			close(fd);
+			return -1;
+		}
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+		*kind = "memfd";
+		return fd;
+	}
+#endif
 
-	shm_unlink(name);
+	fd = create_shm_file();
+	if (fd == -1)
+		return -1;
+	if (ftruncate(fd, size) == -1) {
+		close(fd);
+		return -1;
+	}
+	*kind = "shm";
 	return fd;
 }
 
 static void
-wl_buffer_release(void *data, struct wl_buffer *wl_buffer)
+buffer_destroy(struct jab_buffer *buffer)
 {
-	wl_buffer_destroy(wl_buffer);
+	wl_buffer_destroy(buffer->wl_buffer);
+	pixman_image_unref(buffer->image);
+	if (!buffer->borrowed)
+		munmap(buffer->data, buffer->size);
+	free(buffer);
+}
+
+static void
+buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct jab_buffer *buffer = data;
+	struct jab_buffer_pool *pool = buffer->pool;
+
+	buffer->busy = false;
+	if (buffer->refs == 0)
+		buffer_destroy(buffer);
+	if (pool && pool->waiting) {
+		pool->waiting = false;
+		if (pool->release)
+			pool->release(pool->data);
+	}
 }
 
 static const struct wl_buffer_listener buffer_listener = {
-    .release = wl_buffer_release,
+    .release = buffer_release,
 };
 
+static bool prefault = true;
+
 void
-unmap_image_data(pixman_image_t *image, void *data)
+buffer_set_prefault(bool enable)
 {
-	munmap(pixman_image_get_data(image), pixman_image_get_height(image) * pixman_image_get_stride(image));
+	prefault = enable;
 }
 
-pixman_image_t *
-create_surface_image(struct wl_shm *shm, int width, int height, struct wl_surface *surface)
+static void *
+map_shm_file(int fd, size_t size)
+{
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	long page;
+
+	if (data == MAP_FAILED)
+		return data;
+#ifdef MADV_HUGEPAGE
+	/* shmem only backs a mapping with transparent huge pages if asked before the pages
+	 * are allocated, and only if shmem_enabled allows it */
+	madvise(data, size, MADV_HUGEPAGE);
+#endif
+	if (!prefault)
+		return data;
+
+	/* Take the page faults now instead of one 4 KiB page at a time while rendering */
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(data, size, MADV_POPULATE_WRITE) == 0)
+		return data;
+#endif
+	/* Otherwise touch every page, which still allocates them as advised above. The file
+	 * is new, so writing zeroes changes nothing. */
+	page = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < size; i += page > 0 ? page : 4096)
+		((volatile unsigned char *)data)[i] = 0;
+	return data;
+}
+
+static pixman_format_code_t
+pixman_format(uint32_t format)
+{
+	switch (format) {
+	case WL_SHM_FORMAT_ARGB8888: return PIXMAN_a8r8g8b8;
+	case WL_SHM_FORMAT_XBGR8888: return PIXMAN_x8b8g8r8;
+	case WL_SHM_FORMAT_ABGR8888: return PIXMAN_a8b8g8r8;
+	case WL_SHM_FORMAT_RGB565: return PIXMAN_r5g6b5;
+	default: return PIXMAN_x8r8g8b8;
+	}
+}
+
+static pixman_image_t *
+create_image(pixman_format_code_t format, int width, int height, void *data, int stride)
 {
-	const int stride = width * 4;
-	const int size = height * stride;
+	pixman_image_t *image = pixman_image_create_bits_no_clear(format, width, height, data,
+			stride);
+
+#if PIXMAN_VERSION >= PIXMAN_VERSION_ENCODE(0, 39, 0)
+	/* Hide the banding of 16-bit formats */
+	if (PIXMAN_FORMAT_BPP(format) < 24)
+		pixman_image_set_dither(image, PIXMAN_DITHER_ORDERED_BAYER_8);
+#endif
+	return image;
+}
+
+struct jab_buffer *
+buffer_create(struct wl_shm *shm, int width, int height, uint32_t format)
+{
+	const pixman_format_code_t pformat = pixman_format(format);
+	/* Pixman wants rows aligned to 32 bits, which matters for 16-bit formats */
+	const int stride = (width * PIXMAN_FORMAT_BPP(pformat) + 31) / 32 * 4;
+	const size_t size = (size_t)height * stride;
+	const char *kind;
+	double start = now_ms();
 	int fd;
-	uint32_t *data;
+	void *data;
 	struct wl_shm_pool *pool;
-	struct wl_buffer *wl_buffer;
-	pixman_image_t *image;
+	struct jab_buffer *buffer;
 
-	fd = allocate_shm_file(size);
+	fd = allocate_shm_file(size, &kind);
 	if (fd == -1)
 		goto err;
 
-	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED)
+	data = map_shm_file(fd, size);
+	if (data == MAP_FAILED) {
+		close(fd);
 		goto err;
+	}
 
+	buffer = calloc(1, sizeof *buffer);
+	if (!buffer) {
+		munmap(data, size);
+		close(fd);
+		goto err;
+	}
 	pool = wl_shm_create_pool(shm, fd, size);
-	wl_buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, WL_SHM_FORMAT_XRGB8888);
+	buffer->wl_buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, format);
 	wl_shm_pool_destroy(pool);
 	close(fd);
 
-	wl_buffer_add_listener(wl_buffer, &buffer_listener, NULL);
-	wl_surface_attach(surface, wl_buffer, 0, 0);
-	image = pixman_image_create_bits_no_clear(PIXMAN_x8r8g8b8, width, height, data, stride);
-	pixman_image_set_destroy_function(image, unmap_image_data, NULL);
-	return image;
+	wl_buffer_add_listener(buffer->wl_buffer, &buffer_listener, buffer);
+	buffer->data = data;
+	buffer->size = size;
+	buffer->width = width;
+	buffer->height = height;
+	buffer->format = format;
+	buffer->image = create_image(pformat, width, height, data, stride);
+	buffer->refs = 1;
+	log_debug("allocated %dx%d %s buffer with format 0x%08x in %.3f ms",
+			width, height, kind, format, now_ms() - start);
+	return buffer;
 
 err:
-	if (fd >= 0)
-		close(fd);
+	fprintf(stderr, "jab: failed to allocate %dx%d buffer\n", width, height);
 	return NULL;
 }
+
+pixman_image_t *
+buffer_create_stripe(struct jab_buffer *buffer, int y, int height)
+{
+	const int stride = pixman_image_get_stride(buffer->image);
+
+	return create_image(pixman_image_get_format(buffer->image), buffer->width, height,
+			(char *)buffer->data + (size_t)y * stride, stride);
+}
+
+/* Precedes the memory returned by buffer_alloc(). Its size keeps that memory aligned for
+ * vector loads and stores. */
+struct alloc {
+	int fd; /* -1 if allocated with malloc() */
+	size_t size, mapped;
+};
+
+#define ALLOC_HEADER 64
+
+void *
+buffer_alloc(size_t size, bool shareable)
+{
+	struct alloc *alloc = MAP_FAILED;
+	const char *kind;
+	int fd = -1;
+
+	if (shareable && (fd = allocate_shm_file(size + ALLOC_HEADER, &kind)) != -1) {
+		alloc = map_shm_file(fd, size + ALLOC_HEADER);
+		if (alloc == MAP_FAILED)
+			close(fd);
+	}
+	if (alloc == MAP_FAILED) {
+		fd = -1;
+		alloc = malloc(size + ALLOC_HEADER);
+		if (!alloc)
+			return NULL;
+	}
+
+	alloc->fd = fd;
+	alloc->size = size;
+	alloc->mapped = fd == -1 ? 0 : size + ALLOC_HEADER;
+	return (char *)alloc + ALLOC_HEADER;
+}
+
+void *
+buffer_realloc(void *data, size_t size, bool shareable)
+{
+	struct alloc *alloc;
+	void *moved;
+
+	if (!data)
+		return buffer_alloc(size, shareable);
+	alloc = (struct alloc *)((char *)data - ALLOC_HEADER);
+	if (alloc->fd == -1 && !shareable) {
+		alloc = realloc(alloc, size + ALLOC_HEADER);
+		if (!alloc)
+			return NULL;
+		alloc->size = size;
+		return (char *)alloc + ALLOC_HEADER;
+	}
+
+	/* Mappings are sealed to their size, so move */
+	moved = buffer_alloc(size, shareable);
+	if (!moved)
+		return NULL;
+	memcpy(moved, data, alloc->size < size ? alloc->size : size);
+	buffer_free(data);
+	return moved;
+}
+
+void
+buffer_free(void *data)
+{
+	struct alloc *alloc;
+
+	if (!data)
+		return;
+	alloc = (struct alloc *)((char *)data - ALLOC_HEADER);
+	if (alloc->fd == -1) {
+		free(alloc);
+	} else {
+		close(alloc->fd);
+		munmap(alloc, alloc->mapped);
+	}
+}
+
+struct jab_buffer *
+buffer_create_from(struct wl_shm *shm, void *data, int width, int height, uint32_t format)
+{
+	const struct alloc *alloc = (const struct alloc *)((char *)data - ALLOC_HEADER);
+	struct wl_shm_pool *pool;
+	struct jab_buffer *buffer;
+
+	if (alloc->fd == -1 || alloc->size < (size_t)width * height * 4)
+		return NULL;
+	buffer = calloc(1, sizeof *buffer);
+	if (!buffer)
+		return NULL;
+
+	pool = wl_shm_create_pool(shm, alloc->fd, alloc->mapped);
+	buffer->wl_buffer = wl_shm_pool_create_buffer(pool, ALLOC_HEADER, width, height,
+			width * 4, format);
+	wl_shm_pool_destroy(pool);
+
+	wl_buffer_add_listener(buffer->wl_buffer, &buffer_listener, buffer);
+	buffer->data = data;
+	buffer->size = (size_t)width * height * 4;
+	buffer->width = width;
+	buffer->height = height;
+	buffer->format = format;
+	buffer->borrowed = true;
+	buffer->image = create_image(pixman_format(format), width, height, data, width * 4);
+	buffer->refs = 1;
+	return buffer;
+}
+
+struct jab_buffer *
+buffer_ref(struct jab_buffer *buffer)
+{
+	buffer->refs++;
+	return buffer;
+}
+
+void
+buffer_unref(struct jab_buffer *buffer)
+{
+	/* A buffer still held by the compositor is destroyed once it is released */
+	if (--buffer->refs == 0 && !buffer->busy)
+		buffer_destroy(buffer);
+}
+
+bool
+buffer_key_equal(const struct jab_buffer_key *a, const struct jab_buffer_key *b)
+{
+	return a->width == b->width && a->height == b->height && a->format == b->format &&
+		a->scale == b->scale && a->transform == b->transform && a->mode == b->mode &&
+		a->filter == b->filter && a->image == b->image &&
+		a->color.red == b->color.red && a->color.green == b->color.green &&
+		a->color.blue == b->color.blue && a->color.alpha == b->color.alpha;
+}
+
+struct jab_buffer *
+buffer_pool_get(struct jab_buffer_pool *pool, struct wl_shm *shm, int width, int height,
+		uint32_t format)
+{
+	struct jab_buffer *buffer;
+	int i, slot = -1;
+
+	pool->waiting = false;
+	/* Prefer an idle buffer that already has the right size, so steady-state re-renders
+	 * reuse the existing mapping. A buffer that other outputs still display is handed
+	 * over to them and its slot gets a fresh buffer. */
+	for (i = 0; i < POOL_SIZE; i++) {
+		buffer = pool->buffers[i];
+		if (!buffer) {
+			if (slot == -1)
+				slot = i;
+			continue;
+		}
+		if (buffer == pool->current || (buffer->refs == 1 && buffer->busy))
+			continue;
+		if (buffer->refs == 1 && buffer->width == width && buffer->height == height &&
+				buffer->format == format) {
+			buffer->key_valid = false;
+			return buffer;
+		}
+		if (slot == -1)
+			slot = i;
+	}
+
+	if (slot == -1) {
+		pool->waiting = true;
+		return NULL;
+	}
+
+	if (pool->buffers[slot]) {
+		pool->buffers[slot]->pool = NULL;
+		buffer_unref(pool->buffers[slot]);
+	}
+	pool->buffers[slot] = buffer_create(shm, width, height, format);
+	if (pool->buffers[slot])
+		pool->buffers[slot]->pool = pool;
+	return pool->buffers[slot];
+}
+
+void
+buffer_pool_attach(struct jab_buffer_pool *pool, struct jab_buffer *buffer,
+		struct wl_surface *surface)
+{
+	buffer_ref(buffer);
+	if (pool->current)
+		buffer_unref(pool->current);
+	pool->current = buffer;
+
+	wl_surface_attach(surface, buffer->wl_buffer, 0, 0);
+	buffer->busy = true;
+}
+
+void
+buffer_pool_drop_current(struct jab_buffer_pool *pool)
+{
+	if (pool->current)
+		buffer_unref(pool->current);
+	pool->current = NULL;
+}
+
+void
+buffer_pool_finish(struct jab_buffer_pool *pool)
+{
+	for (int i = 0; i < POOL_SIZE; i++) {
+		if (pool->buffers[i]) {
+			pool->buffers[i]->pool = NULL;
+			buffer_unref(pool->buffers[i]);
+		}
+	}
+	buffer_pool_drop_current(pool);
+	*pool = (struct jab_buffer_pool){.release = pool->release, .data = pool->data};
+}
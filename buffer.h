@@ -2,9 +2,83 @@
 #define BUFFER_H
 
 #include <pixman.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <wayland-client.h>
 
-pixman_image_t *create_surface_image(struct wl_shm *shm, int width, int height,
+/* Number of buffers per output, enough for double buffering */
+#define POOL_SIZE 2
+
+/* Everything that determines the contents of a rendered buffer. Outputs whose keys are
+ * equal can attach the same buffer instead of rendering their own. */
+struct jab_buffer_key {
+	int width, height, scale, transform;
+	uint32_t format;
+	int mode, filter;
+	const void *image;
+	pixman_color_t color;
+};
+
+struct jab_buffer {
+	struct wl_buffer *wl_buffer;
+	pixman_image_t *image;
+	void *data;
+	size_t size;
+	int width, height;
+	uint32_t format; /* A wl_shm format */
+	bool borrowed; /* Shows memory from buffer_alloc(), which outlives it */
+
+	int refs; /* Held by the owning pool and by every output displaying it */
+	bool busy; /* Attached and not yet released by the compositor */
+	struct jab_buffer_pool *pool; /* Owning pool, if any */
+	bool key_valid;
+	struct jab_buffer_key key;
+};
+
+struct jab_buffer_pool {
+	struct jab_buffer *buffers[POOL_SIZE];
+	struct jab_buffer *current; /* Attached to the output, possibly owned by another pool */
+
+	/* Called once the compositor releases one of the buffers after buffer_pool_get()
+	 * found them all held */
+	void (*release)(void *data);
+	void *data;
+	bool waiting;
+};
+
+/* Whether new buffers are populated up front, on by default */
+void buffer_set_prefault(bool enable);
+
+/* Creates a buffer holding a single reference. The format can be any of the 32-bit RGB
+ * formats or RGB565, which is dithered when rendered into. */
+struct jab_buffer *buffer_create(struct wl_shm *shm, int width, int height, uint32_t format);
+/* Allocates memory like malloc(), which if shareable is set is backed by a file that
+ * wl_shm can share with the compositor. Falls back to malloc() if that fails. */
+void *buffer_alloc(size_t size, bool shareable);
+/* Resizes memory from buffer_alloc(), moving it if it is or becomes shareable */
+void *buffer_realloc(void *data, size_t size, bool shareable);
+void buffer_free(void *data);
+/* Creates a buffer showing the 32-bit pixels of shareable memory from buffer_alloc()
+ * without copying. Returns NULL if the memory is not shareable. */
+struct jab_buffer *buffer_create_from(struct wl_shm *shm, void *data, int width, int height,
+		uint32_t format);
+/* Creates an image of the rows y up to y + height of buffer, rendering into which gives the
+ * same result as into those rows of buffer->image */
+pixman_image_t *buffer_create_stripe(struct jab_buffer *buffer, int y, int height);
+struct jab_buffer *buffer_ref(struct jab_buffer *buffer);
+void buffer_unref(struct jab_buffer *buffer);
+bool buffer_key_equal(const struct jab_buffer_key *a, const struct jab_buffer_key *b);
+
+/* Returns an idle buffer of the given size and format, reallocating one only when no idle buffer
+ * matches. Returns NULL if allocation failed or every buffer is still held by the
+ * compositor, in which case the pool's release callback is called once one is released. */
+struct jab_buffer *buffer_pool_get(struct jab_buffer_pool *pool, struct wl_shm *shm,
+		int width, int height, uint32_t format);
+/* Attaches buffer to surface and makes it the pool's current buffer */
+void buffer_pool_attach(struct jab_buffer_pool *pool, struct jab_buffer *buffer,
 		struct wl_surface *surface);
+/* Forgets the current buffer after attaching one that is not managed by a pool */
+void buffer_pool_drop_current(struct jab_buffer_pool *pool);
+void buffer_pool_finish(struct jab_buffer_pool *pool);
 
 #endif /* BUFFER_H */
@@ -5,10 +5,15 @@ PREFIX = /usr/local
 WAYLAND_PROTOCOLS = /usr/share/wayland-protocols
 WAYLAND_SCANNER = wayland-scanner
 
+# libjpeg-turbo, used instead of stb_image for JPEG images, uncomment to enable. It also
+# decodes them scaled down to the outputs.
+#JPEGCPPFLAGS = -DHAVE_LIBJPEG
+#JPEGLIBS = -ljpeg
+
 INCS = -I/usr/include/pixman-1
-LIBS = -lpixman-1 -lwayland-client -lm
+LIBS = -lpixman-1 -lwayland-client -lm -lpthread $(JPEGLIBS)
 
-CPPFLAGS = -D_POSIX_C_SOURCE=200112L -DVERSION=\"$(VERSION)\"
+CPPFLAGS = -D_POSIX_C_SOURCE=200112L -DVERSION=\"$(VERSION)\" $(JPEGCPPFLAGS)
 CFLAGS = -std=c99 -Wall -Wno-deprecated-declarations -O2 $(INCS) $(CPPFLAGS)
 #CFLAGS = -g -std=c99 -Wall -Wno-deprecated-declarations -O0 $(INCS) $(CPPFLAGS)
 LDFLAGS = $(LIBS)
@@ -0,0 +1,131 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "convert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Exact rounded division by 255, as pixman does it */
+static inline uint32_t
+div_255(uint32_t x)
+{
+	x += 0x80;
+	return (x + (x >> 8)) >> 8;
+}
+
+static bool
+convert_scalar(uint32_t *pixels, size_t count)
+{
+	uint32_t opaque = 0xff;
+
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t *p = (const uint8_t *)&pixels[i];
+		uint32_t r = p[0], g = p[1], b = p[2], a = p[3];
+
+		if (a != 0xff) {
+			r = div_255(r * a);
+			g = div_255(g * a);
+			b = div_255(b * a);
+		}
+		opaque &= a;
+		pixels[i] = a << 24 | r << 16 | g << 8 | b;
+	}
+	return opaque == 0xff;
+}
+
+#ifdef HAVE_X86_SIMD
+/* The vector kernels below swap R and B, then premultiply in 16 bits per channel with
+ * the same rounding as div_255(). Vectors that are fully opaque skip the multiply. */
+
+__attribute__((target("sse2"))) static bool
+convert_sse2(uint32_t *pixels, size_t count)
+{
+	const __m128i mask_rb = _mm_set1_epi32(0x00ff00ff), mask_ga = _mm_set1_epi32(0xff00ff00);
+	const __m128i mask_a = _mm_set1_epi32(0xff000000), round = _mm_set1_epi16(0x80);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_set1_epi32(-1);
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&pixels[i]);
+		__m128i rb = _mm_and_si128(v, mask_rb), lo, hi, alo, ahi;
+
+		rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+		v = _mm_or_si128(_mm_and_si128(v, mask_ga), rb);
+		acc = _mm_and_si128(acc, v);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, mask_a), mask_a)) != 0xffff) {
+			lo = _mm_unpacklo_epi8(v, zero);
+			hi = _mm_unpackhi_epi8(v, zero);
+			alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff);
+			ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff);
+			lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), round);
+			hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), round);
+			lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+			hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+			/* Put back the alpha channel, which the multiply squared */
+			v = _mm_or_si128(_mm_andnot_si128(mask_a, _mm_packus_epi16(lo, hi)),
+					_mm_and_si128(v, mask_a));
+		}
+		_mm_storeu_si128((__m128i *)&pixels[i], v);
+	}
+
+	acc = _mm_cmpeq_epi32(_mm_and_si128(acc, mask_a), mask_a);
+	return (convert_scalar(pixels + i, count - i) & (_mm_movemask_epi8(acc) == 0xffff));
+}
+
+__attribute__((target("avx2"))) static bool
+convert_avx2(uint32_t *pixels, size_t count)
+{
+	const __m256i mask_rb = _mm256_set1_epi32(0x00ff00ff);
+	const __m256i mask_ga = _mm256_set1_epi32(0xff00ff00);
+	const __m256i mask_a = _mm256_set1_epi32(0xff000000), round = _mm256_set1_epi16(0x80);
+	const __m256i zero = _mm256_setzero_si256();
+	/* Broadcasts each pixel's alpha over its four 16-bit channels */
+	const __m256i alpha = _mm256_setr_epi8(6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+			6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15);
+	__m256i acc = _mm256_set1_epi32(-1);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&pixels[i]);
+		__m256i rb = _mm256_and_si256(v, mask_rb), lo, hi;
+
+		rb = _mm256_or_si256(_mm256_slli_epi32(rb, 16), _mm256_srli_epi32(rb, 16));
+		v = _mm256_or_si256(_mm256_and_si256(v, mask_ga), rb);
+		acc = _mm256_and_si256(acc, v);
+
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(v, mask_a), mask_a)) != -1) {
+			lo = _mm256_unpacklo_epi8(v, zero);
+			hi = _mm256_unpackhi_epi8(v, zero);
+			lo = _mm256_add_epi16(_mm256_mullo_epi16(lo, _mm256_shuffle_epi8(lo, alpha)), round);
+			hi = _mm256_add_epi16(_mm256_mullo_epi16(hi, _mm256_shuffle_epi8(hi, alpha)), round);
+			lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+			hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+			v = _mm256_or_si256(_mm256_andnot_si256(mask_a, _mm256_packus_epi16(lo, hi)),
+					_mm256_and_si256(v, mask_a));
+		}
+		_mm256_storeu_si256((__m256i *)&pixels[i], v);
+	}
+
+	acc = _mm256_cmpeq_epi32(_mm256_and_si256(acc, mask_a), mask_a);
+	return (convert_sse2(pixels + i, count - i) & (_mm256_movemask_epi8(acc) == -1));
+}
+#endif
+
+bool
+convert_rgba_to_argb(uint32_t *pixels, size_t count)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return convert_avx2(pixels, count);
+	if (__builtin_cpu_supports("sse2"))
+		return convert_sse2(pixels, count);
+#endif
+	return convert_scalar(pixels, count);
+}
@@ -0,0 +1,13 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Converts count straight-alpha RGBA pixels, as returned by stb_image, in place to
+ * premultiplied native-endian ARGB words (PIXMAN_a8r8g8b8). Returns whether every pixel
+ * is opaque, in which case the result can be treated as PIXMAN_x8r8g8b8. */
+bool convert_rgba_to_argb(uint32_t *pixels, size_t count);
+
+#endif /* CONVERT_H */
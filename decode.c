@@ -0,0 +1,84 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "buffer.h"
+#include "convert.h"
+#include "decode.h"
+#include "log.h"
+
+/* Tried in order. stb_image handles every format jab supports, so it comes last. */
+static const struct decoder *const decoders[] = {
+#ifdef HAVE_LIBJPEG
+	&jpeg_decoder,
+#endif
+	&stb_decoder,
+};
+
+#define LENGTH(a) (sizeof(a) / sizeof((a)[0]))
+
+bool
+decode_info(const unsigned char *data, size_t size, int *width, int *height)
+{
+	for (size_t i = 0; i < LENGTH(decoders); i++)
+		if (decoders[i]->info && decoders[i]->info(data, size, width, height))
+			return true;
+	return false;
+}
+
+void
+decode_rows(struct decode *decode, int y)
+{
+	if (y <= decode->rows_done)
+		return;
+	decode->opaque &= convert_rgba_to_argb(
+			(uint32_t *)decode->pixels + (size_t)decode->rows_done * decode->width,
+			(size_t)(y - decode->rows_done) * decode->width);
+	decode->rows_done = y;
+}
+
+bool
+decode_band(const struct decode *decode, int y0, int y1)
+{
+	return convert_rgba_to_argb((uint32_t *)decode->pixels + (size_t)y0 * decode->width,
+			(size_t)(y1 - y0) * decode->width);
+}
+
+uint32_t *
+decode_image(const unsigned char *data, size_t size, int min_width, int min_height,
+		int *width, int *height, bool *opaque)
+{
+	const char *error = NULL;
+	double start, elapsed;
+
+	for (size_t i = 0; i < LENGTH(decoders); i++) {
+		struct decode decode = {
+			.data = data, .size = size, .min_width = min_width,
+			.min_height = min_height, .opaque = true,
+		};
+
+		start = now_ms();
+		if (!decoders[i]->load(&decode)) {
+			if (decode.error) {
+				log_debug("%s: %s", decoders[i]->name, decode.error);
+				error = decode.error;
+			}
+			continue;
+		}
+		decode_rows(&decode, decode.height);
+		elapsed = now_ms() - start;
+		log_debug("%s decoded %dx%d image in %.3f ms, %.1f MB/s in, %.1f Mpixel/s out",
+				decoders[i]->name, decode.width, decode.height, elapsed,
+				size / elapsed / 1e3,
+				(double)decode.width * decode.height / elapsed / 1e3);
+
+		*width = decode.width;
+		*height = decode.height;
+		*opaque = decode.opaque;
+		return (uint32_t *)decode.pixels;
+	}
+
+	fprintf(stderr, "jab: failed to load image: %s\n", error ? error : "unknown format");
+	return NULL;
+}
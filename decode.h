@@ -0,0 +1,54 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* An image being decoded by one of the backends, which are tried in turn */
+struct decode {
+	const unsigned char *data;
+	size_t size;
+	/* Backends that can scale while decoding may go down to this size */
+	int min_width, min_height;
+
+	/* Set by the backend. The pixels are straight-alpha RGBA and come from
+	 * buffer_alloc(), sized for the decoded image to become a wl_buffer. */
+	unsigned char *pixels;
+	int width, height;
+	const char *error; /* Left NULL if the data is not in the backend's format */
+
+	int rows_done; /* Rows already passed to decode_rows() */
+	bool opaque;
+};
+
+struct decoder {
+	const char *name;
+	/* Reads the size of the image without decoding it. May be NULL. */
+	bool (*info)(const unsigned char *data, size_t size, int *width, int *height);
+	bool (*load)(struct decode *decode);
+};
+
+extern const struct decoder stb_decoder;
+#ifdef HAVE_LIBJPEG
+extern const struct decoder jpeg_decoder;
+#endif
+
+/* Reads the size of an image without decoding it */
+bool decode_info(const unsigned char *data, size_t size, int *width, int *height);
+/* Decodes an image into premultiplied native-endian ARGB words, at least min_width x
+ * min_height if the backend scales it down. Prints an error and returns NULL on failure.
+ * The result is freed with buffer_free(). */
+uint32_t *decode_image(const unsigned char *data, size_t size, int min_width, int min_height,
+		int *width, int *height, bool *opaque);
+
+/* Called by backends that decode row by row once rows up to y are complete, so that
+ * they are converted while still in cache. The remaining rows are converted once the
+ * backend returns. */
+void decode_rows(struct decode *decode, int y);
+/* Converts rows y0 up to y1 like decode_rows(), for backends decoding several bands of
+ * rows at once on the workers. These then set rows_done and opaque themselves. Returns
+ * whether the rows are opaque. */
+bool decode_band(const struct decode *decode, int y0, int y1);
+
+#endif /* DECODE_H */
@@ -2,6 +2,9 @@
 #include <pixman.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <wayland-client.h>
+
+#include "image-mode.h"
 
 static void
 image_fit_or_fill(pixman_image_t *src, int width, int height, bool fill)
@@ -60,3 +63,161 @@ image_tile(pixman_image_t *src, int width, int height)
 {
 	pixman_image_set_repeat(src, PIXMAN_REPEAT_NORMAL);
 }
+
+int
+image_integer_scale(int src_width, int src_height, int width, int height)
+{
+	const int sx = width / src_width, sy = height / src_height;
+	const int s = sx < sy ? sx : sy;
+
+	return s > 1 ? s : 1;
+}
+
+void
+image_integer(pixman_image_t *src, int width, int height)
+{
+	int src_width = pixman_image_get_width(src), src_height = pixman_image_get_height(src);
+	int s = image_integer_scale(src_width, src_height, width, height);
+	pixman_transform_t t;
+
+	/* Same rounding as image_center() on the scaled image */
+	pixman_transform_init_translate(&t, pixman_int_to_fixed((src_width * s - width) / 2),
+			pixman_int_to_fixed((src_height * s - height) / 2));
+	pixman_transform_scale(&t, NULL, pixman_double_to_fixed(1. / s),
+			pixman_double_to_fixed(1. / s));
+	pixman_image_set_transform(src, &t);
+}
+
+bool
+image_viewport(int mode, int src_width, int src_height, int width, int height,
+		struct image_viewport *vp)
+{
+	double sx = (double)width / src_width, sy = (double)height / src_height, s;
+	int offset;
+
+	*vp = (struct image_viewport){0, 0, src_width, src_height, 0, 0, width, height};
+
+	switch (mode) {
+	case ModeFill:
+		s = fmax(sx, sy);
+		vp->src_width = fmin(width / s, src_width);
+		vp->src_height = fmin(height / s, src_height);
+		vp->src_x = (src_width - vp->src_width) / 2;
+		vp->src_y = (src_height - vp->src_height) / 2;
+		return true;
+	case ModeFit:
+		s = fmin(sx, sy);
+		vp->dst_width = fmax(round(src_width * s), 1);
+		vp->dst_height = fmax(round(src_height * s), 1);
+		vp->dst_x = (width - vp->dst_width) / 2;
+		vp->dst_y = (height - vp->dst_height) / 2;
+		return true;
+	case ModeStretch:
+		return true;
+	case ModeCenter:
+		/* Same rounding as the translation in image_center() */
+		offset = (src_width - width) / 2;
+		vp->src_x = offset > 0 ? offset : 0;
+		vp->dst_x = offset < 0 ? -offset : 0;
+		vp->src_width = vp->dst_width = fmin(src_width - vp->src_x, width - vp->dst_x);
+		offset = (src_height - height) / 2;
+		vp->src_y = offset > 0 ? offset : 0;
+		vp->dst_y = offset < 0 ? -offset : 0;
+		vp->src_height = vp->dst_height = fmin(src_height - vp->src_y, height - vp->dst_y);
+		return true;
+	case ModeInteger:
+		/* Like center, on the scaled image. Only an unscaled image can be cropped. */
+		s = image_integer_scale(src_width, src_height, width, height);
+		offset = (src_width * (int)s - width) / 2;
+		vp->src_x = offset > 0 ? offset : 0;
+		vp->dst_x = offset < 0 ? -offset : 0;
+		vp->dst_width = fmin(src_width * s - vp->src_x, width - vp->dst_x);
+		vp->src_width = vp->dst_width / s;
+		offset = (src_height * (int)s - height) / 2;
+		vp->src_y = offset > 0 ? offset : 0;
+		vp->dst_y = offset < 0 ? -offset : 0;
+		vp->dst_height = fmin(src_height * s - vp->src_y, height - vp->dst_y);
+		vp->src_height = vp->dst_height / s;
+		return true;
+	default:
+		return false;
+	}
+}
+
+void
+image_transform(pixman_image_t *src, int transform, int width, int height)
+{
+	const pixman_fixed_t w = pixman_int_to_fixed(width), h = pixman_int_to_fixed(height);
+	const pixman_fixed_t one = pixman_fixed_1;
+	pixman_transform_t t, r = {{{one, 0, 0}, {0, one, 0}, {0, 0, one}}};
+	const pixman_transform_t *current = pixman_image_get_transform(src);
+
+	/* Maps buffer coordinates back to surface coordinates, the inverse of what the
+	 * compositor applies for the buffer transform */
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+		return;
+	case WL_OUTPUT_TRANSFORM_90:
+		r = (pixman_transform_t){{{0, -one, w}, {one, 0, 0}, {0, 0, one}}};
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		r = (pixman_transform_t){{{-one, 0, w}, {0, -one, h}, {0, 0, one}}};
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		r = (pixman_transform_t){{{0, one, 0}, {-one, 0, h}, {0, 0, one}}};
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		r = (pixman_transform_t){{{-one, 0, w}, {0, one, 0}, {0, 0, one}}};
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		r = (pixman_transform_t){{{0, one, 0}, {one, 0, 0}, {0, 0, one}}};
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		r = (pixman_transform_t){{{one, 0, 0}, {0, -one, h}, {0, 0, one}}};
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		r = (pixman_transform_t){{{0, -one, w}, {-one, 0, h}, {0, 0, one}}};
+		break;
+	}
+
+	if (current)
+		pixman_transform_multiply(&t, current, &r);
+	else
+		t = r;
+	pixman_image_set_transform(src, &t);
+}
+
+void
+image_box(pixman_image_t *src, int width, int height, pixman_box32_t *box)
+{
+	const pixman_transform_t *t = pixman_image_get_transform(src);
+	const int src_width = pixman_image_get_width(src), src_height = pixman_image_get_height(src);
+	struct pixman_f_transform ft, inverse;
+	double x1 = 0, y1 = 0, x2 = src_width, y2 = src_height;
+
+	if (t) {
+		/* The transform maps destination to source, so map the source corners back */
+		pixman_f_transform_from_pixman(&ft, t);
+		if (pixman_f_transform_invert(&inverse, &ft)) {
+			x1 = y1 = INFINITY;
+			x2 = y2 = -INFINITY;
+			for (int i = 0; i < 4; i++) {
+				struct pixman_f_vector v = {{i & 1 ? src_width : 0, i & 2 ? src_height : 0, 1}};
+				pixman_f_transform_point(&inverse, &v);
+				x1 = fmin(x1, v.v[0]);
+				y1 = fmin(y1, v.v[1]);
+				x2 = fmax(x2, v.v[0]);
+				y2 = fmax(y2, v.v[1]);
+			}
+		}
+	}
+
+	box->x1 = fmax(round(x1), 0);
+	box->y1 = fmax(round(y1), 0);
+	box->x2 = fmin(round(x2), width);
+	box->y2 = fmin(round(y2), height);
+	if (box->x2 < box->x1)
+		box->x2 = box->x1;
+	if (box->y2 < box->y1)
+		box->y2 = box->y1;
+}
@@ -2,11 +2,40 @@
 #define IMAGE_MODE_H
 
 #include <pixman.h>
+#include <stdbool.h>
+
+/* Image display mode */
+enum { ModeFill, ModeFit, ModeStretch, ModeCenter, ModeTile, ModeInteger, ModeInvalid };
+
+/* The part of the source image that is visible on the surface, and the surface rectangle
+ * it is scaled into */
+struct image_viewport {
+	double src_x, src_y, src_width, src_height;
+	int dst_x, dst_y, dst_width, dst_height;
+};
 
 void image_fill(pixman_image_t *src, int width, int height);
 void image_fit(pixman_image_t *src, int width, int height);
 void image_stretch(pixman_image_t *src, int width, int height);
 void image_center(pixman_image_t *src, int width, int height);
 void image_tile(pixman_image_t *src, int width, int height);
+/* Scales src by the largest whole factor that fits, at least 1, and centers it. Meant for
+ * nearest filtering, which then repeats every pixel the same number of times. */
+void image_integer(pixman_image_t *src, int width, int height);
+/* The factor image_integer() scales by */
+int image_integer_scale(int src_width, int src_height, int width, int height);
+
+/* Rotates and flips src so that it is rendered into a buffer already carrying the given
+ * wl_output_transform. Must be called after the mode function. */
+void image_transform(pixman_image_t *src, int transform, int width, int height);
+
+/* Computes the part of a width x height destination that src covers with its current
+ * transform, rounded to whole pixels. Pixels outside of it only show the background. */
+void image_box(pixman_image_t *src, int width, int height, pixman_box32_t *box);
+
+/* Computes the same placement as the functions above for presenting the image through a
+ * viewport. Returns false for modes that a single viewport cannot express. */
+bool image_viewport(int mode, int src_width, int src_height, int width, int height,
+		struct image_viewport *vp);
 
 #endif /* IMAGE_MODE_H */
@@ -0,0 +1,114 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "log.h"
+
+static bool
+read_all(struct input *input, int fd)
+{
+	size_t capacity = 1 << 16;
+	unsigned char *data;
+	ssize_t n;
+
+	input->data = malloc(capacity);
+	if (!input->data)
+		return false;
+	for (;;) {
+		if (input->size == capacity) {
+			data = realloc(input->data, capacity *= 2);
+			if (!data)
+				return false;
+			input->data = data;
+		}
+		n = read(fd, input->data + input->size, capacity - input->size);
+		if (n == 0)
+			return true;
+		if (n == -1 && errno != EINTR)
+			return false;
+		if (n > 0)
+			input->size += n;
+	}
+}
+
+static bool
+map_file(struct input *input, int fd)
+{
+	struct stat st;
+	void *data;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return false;
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return false;
+	/* Decoders read the file front to back, so read ahead aggressively */
+	posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+	input->data = data;
+	input->size = st.st_size;
+	input->mapped = true;
+	return true;
+}
+
+bool
+input_open(struct input *input, const char *source)
+{
+	const double start = now_ms();
+	bool ok, owned = true;
+	char *end;
+	long number;
+	int fd;
+
+	*input = (struct input){0};
+	if (!strcmp(source, "-")) {
+		fd = STDIN_FILENO;
+		owned = false;
+	} else if (!strncmp(source, "fd:", 3)) {
+		errno = 0;
+		number = strtol(source + 3, &end, 10);
+		if (source[3] == '\0' || *end != '\0' || errno == ERANGE || number < 0 ||
+				number > INT_MAX) {
+			fprintf(stderr, "jab: invalid file descriptor: %s\n", source);
+			return false;
+		}
+		fd = number;
+	} else {
+		fd = open(source, O_RDONLY);
+		if (fd == -1) {
+			fprintf(stderr, "jab: failed to open %s: %s\n", source, strerror(errno));
+			return false;
+		}
+	}
+
+	ok = map_file(input, fd) || read_all(input, fd);
+	if (!ok)
+		fprintf(stderr, "jab: failed to read %s: %s\n", source, strerror(errno));
+	if (owned)
+		close(fd);
+	if (!ok) {
+		input_close(input);
+		return false;
+	}
+
+	log_debug("%s %s: %zu bytes, %zu copied in %.3f ms", input->mapped ? "mapped" : "read",
+			source, input->size, input->mapped ? 0 : input->size, now_ms() - start);
+	return true;
+}
+
+void
+input_close(struct input *input)
+{
+	if (input->mapped)
+		munmap(input->data, input->size);
+	else
+		free(input->data);
+	*input = (struct input){0};
+}
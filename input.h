@@ -0,0 +1,20 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The encoded contents of an image file */
+struct input {
+	unsigned char *data;
+	size_t size;
+	bool mapped;
+};
+
+/* Reads source, which is "-" for standard input, "fd:N" for an inherited descriptor that
+ * jab takes over, or a path. Regular files are mapped instead of copied, anything else
+ * such as a pipe is read into memory. */
+bool input_open(struct input *input, const char *source);
+void input_close(struct input *input);
+
+#endif /* INPUT_H */
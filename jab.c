@@ -1,57 +1,136 @@
+#define _GNU_SOURCE /* RUSAGE_THREAD */
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
 #include <pixman.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
 #include <wayland-client.h>
 #include "tllist/tllist.h"
+#include "fractional-scale-v1-protocol.h"
+#include "single-pixel-buffer-v1-protocol.h"
+#include "viewporter-protocol.h"
 #include "wlr-layer-shell-unstable-v1-protocol.h"
-#define STBI_ONLY_JPEG
-#define STBI_ONLY_PNG
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
 
+#include "blit.h"
 #include "buffer.h"
+#include "decode.h"
 #include "image-mode.h"
+#include "input.h"
+#include "log.h"
+#include "mipmap.h"
+#include "resample.h"
+#include "workers.h"
 
-/* Image display mode */
-enum { ModeFill, ModeFit, ModeStretch, ModeCenter, ModeTile, ModeInvalid };
+/* Rows drawn by one thread at a time. A multiple of 8 keeps ordered dithering aligned,
+ * so the result does not depend on how many threads draw it. */
+#define STRIPE_HEIGHT 64
+
+/* Delay before rendering an output again after allocating its frame failed */
+#define RETRY_MS 16
 
 struct jab_image {
 	unsigned char *buf;
 	int width, height;
+	pixman_format_code_t format;
+	bool opaque;
+
+	/* Box-filtered halvings, the first level being buf itself */
+	struct mipmap_level levels[MIPMAP_MAX_LEVELS];
+	int level_count;
 };
 
+/* How the wl_shm format of rendered buffers is chosen */
+enum { FormatNative, FormatAuto, FormatFixed };
+
 struct jab_output {
 	struct wl_output *wl_output;
 	uint32_t wl_name;
 
 	char name[256], identifier[256];
 	uint32_t width, height;
+	int32_t mode_width, mode_height; /* Of the current mode, in physical pixels */
+	int32_t transform, scale;
+	uint32_t preferred_scale; /* Fractional scale in 120ths, 0 until the compositor sends one */
 
 	struct wl_surface *surface;
 	struct zwlr_layer_surface_v1 *layer_surface;
+	struct wp_viewport *viewport;
+	struct wp_fractional_scale_v1 *fractional_scale;
+	struct jab_buffer_pool pool;
+
+	/* Image subsurface scaled by the compositor, see compositor_scaling */
+	struct wl_surface *image_surface;
+	struct wl_subsurface *subsurface;
+	struct wp_viewport *image_viewport;
+
 	bool dirty, needs_ack;
 	uint32_t configure_serial;
+	unsigned int generation; /* Bumped whenever the output needs a new frame */
+	struct render_job *job; /* Frame being drawn, see render_frame() */
+	/* A dirty output is rendered once this time has come, which lets changes settle
+	 * for coalesce_ms, unless the compositor asks for a frame earlier */
+	double render_after;
+	struct wl_callback *frame_callback;
+};
+
+/* An output's next frame, drawn on a worker thread when it needs drawing. Once the
+ * output needs another frame, the job is cancelled and its result thrown away. */
+struct render_job {
+	struct jab_output *output; /* NULL once the output is gone */
+	unsigned int generation; /* Of the output when the job was set up */
+	bool cancelled; /* Written by the main thread and read by workers atomically */
+	struct jab_buffer *buffer; /* Referenced by the job */
+	struct wl_buffer *single_pixel;
+	/* Jobs showing the same buffer are presented once it is drawn, along with the job
+	 * drawing it. That job links to the first of them, and each of them to the next. */
+	struct render_job *sharing;
+	bool draw, scale_color;
+
+	struct jab_buffer_key key;
+	unsigned int width, height; /* Logical size */
+	unsigned int phys_width, phys_height;
+	bool scale_viewport;
+	double time;
+	long minflt, majflt;
 };
 
 /* Configuration */
 static bool pixel_perfect = false;
+static int filter = FilterPixman;
+static long threads = 0; /* One per online CPU if 0 */
+static long coalesce_ms = 50;
 static pixman_color_t color = {0, 0, 0, 65535};
-static char image_path[256];
+static const char *image_path;
 static int display_mode = ModeInvalid;
+static bool compositor_scaling = false;
+static int format_choice = FormatNative;
+static uint32_t shm_format = WL_SHM_FORMAT_XRGB8888;
 
 /* Application state */
 static struct wl_display *display;
 static struct wl_registry *registry;
 static struct wl_compositor *compositor;
 static struct wl_shm *shm;
+static tll(uint32_t) shm_formats;
+static struct wl_subcompositor *subcompositor;
 static struct zwlr_layer_shell_v1 *layer_shell;
+static struct wp_viewporter *viewporter;
+static struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
+static struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
 static tll(struct jab_output) outputs;
 static struct jab_image image;
+static struct jab_buffer *image_buffer;
 static bool running = false;
 
-static const char usage[] = "usage: jab [-hVp] [-c color] [-i image] [-m mode]\n";
+static const char usage[] = "usage: jab [-hVpPsv] [-c color] [-d delay] [-f format] [-F filter] [-i image]\n"
+	"           [-m mode] [-t threads]\n";
 
 static void
 noop()
@@ -88,57 +167,801 @@ parse_display_mode(const char *mode)
 		return ModeCenter;
 	else if (!strcmp(mode, "tile"))
 		return ModeTile;
+	else if (!strcmp(mode, "integer"))
+		return ModeInteger;
 	return ModeInvalid;
 }
 
+static inline int
+parse_filter(const char *filter)
+{
+	if (!strcmp(filter, "pixman"))
+		return FilterPixman;
+	else if (!strcmp(filter, "bilinear"))
+		return FilterBilinear;
+	else if (!strcmp(filter, "mitchell"))
+		return FilterMitchell;
+	else if (!strcmp(filter, "lanczos3"))
+		return FilterLanczos3;
+	return -1;
+}
+
+static inline bool
+parse_format(const char *format)
+{
+	format_choice = FormatFixed;
+	if (!strcmp(format, "auto"))
+		format_choice = FormatAuto;
+	else if (!strcmp(format, "xrgb8888"))
+		shm_format = WL_SHM_FORMAT_XRGB8888;
+	else if (!strcmp(format, "xbgr8888"))
+		shm_format = WL_SHM_FORMAT_XBGR8888;
+	else if (!strcmp(format, "rgb565"))
+		shm_format = WL_SHM_FORMAT_RGB565;
+	else
+		return false;
+	return true;
+}
+
+static bool
+format_supported(uint32_t format)
+{
+	/* Every compositor has to support these two */
+	if (format == WL_SHM_FORMAT_ARGB8888 || format == WL_SHM_FORMAT_XRGB8888)
+		return true;
+	tll_foreach(shm_formats, it)
+		if (it->item == format)
+			return true;
+	return false;
+}
+
+static uint32_t
+choose_format(void)
+{
+	/* Prefer the 32-bit layout of the decoded pixels, so compositing needs no swizzle */
+	const bool bgr = display_mode != ModeInvalid &&
+		(image.format == PIXMAN_a8b8g8r8 || image.format == PIXMAN_x8b8g8r8);
+	const uint32_t native = bgr && format_supported(WL_SHM_FORMAT_XBGR8888) ?
+		WL_SHM_FORMAT_XBGR8888 : WL_SHM_FORMAT_XRGB8888;
+
+	switch (format_choice) {
+	case FormatAuto:
+		return format_supported(WL_SHM_FORMAT_RGB565) ? WL_SHM_FORMAT_RGB565 : native;
+	case FormatFixed:
+		if (format_supported(shm_format))
+			return shm_format;
+		fputs("jab: requested format unsupported by compositor\n", stderr);
+		/* Fallthrough */
+	default:
+		return native;
+	}
+}
+
 static void
 jab_output_destroy_surface(struct jab_output *output)
 {
+	if (output->frame_callback)
+		wl_callback_destroy(output->frame_callback);
+	/* The frame being drawn is thrown away once it is done */
+	if (output->job) {
+		__atomic_store_n(&output->job->cancelled, true, __ATOMIC_RELAXED);
+		output->job->output = NULL;
+	}
+	if (output->subsurface)
+		wl_subsurface_destroy(output->subsurface);
+	if (output->image_viewport)
+		wp_viewport_destroy(output->image_viewport);
+	if (output->image_surface)
+		wl_surface_destroy(output->image_surface);
+	if (output->fractional_scale)
+		wp_fractional_scale_v1_destroy(output->fractional_scale);
+	if (output->viewport)
+		wp_viewport_destroy(output->viewport);
 	if (output->layer_surface)
 		zwlr_layer_surface_v1_destroy(output->layer_surface);
 	if (output->surface)
 		wl_surface_destroy(output->surface);
+
+	/* A surface created again later starts over */
+	output->frame_callback = NULL;
+	output->job = NULL;
+	output->subsurface = NULL;
+	output->image_viewport = NULL;
+	output->image_surface = NULL;
+	output->fractional_scale = NULL;
+	output->viewport = NULL;
+	output->layer_surface = NULL;
+	output->surface = NULL;
+	output->width = output->height = 0;
+	output->preferred_scale = 0;
+	output->dirty = output->needs_ack = false;
+	output->render_after = 0;
 }
 
 static void
 jab_output_destroy(struct jab_output *output)
 {
 	jab_output_destroy_surface(output);
+	buffer_pool_finish(&output->pool);
 	wl_output_release(output->wl_output);
 }
 
+/* Scale to render at in 120ths, following wp_fractional_scale_v1 */
+static uint32_t
+output_scale(const struct jab_output *output)
+{
+	if (output->fractional_scale && output->preferred_scale)
+		return output->preferred_scale;
+	return output->scale * 120;
+}
+
+/* Looks for an output already displaying a buffer with the given contents */
+static struct jab_buffer *
+find_shared_buffer(const struct jab_buffer_key *key)
+{
+	tll_foreach(outputs, it) {
+		struct jab_buffer *buffer = it->item.pool.current;
+		if (buffer && buffer->key_valid && buffer_key_equal(&buffer->key, key))
+			return buffer;
+	}
+	return NULL;
+}
+
+/* Fills everything outside of box with the background colour */
 static void
-render_frame(struct jab_output *output, unsigned int width, unsigned int height)
+fill_background(pixman_image_t *dst, const pixman_box32_t *box)
 {
-	pixman_image_t *surface_image, *src_image = NULL;
+	const int width = pixman_image_get_width(dst), height = pixman_image_get_height(dst);
+	const pixman_box32_t boxes[] = {
+		{0, 0, width, box->y1},
+		{0, box->y2, width, height},
+		{0, box->y1, box->x1, box->y2},
+		{box->x2, box->y1, width, box->y2},
+	};
+	pixman_box32_t visible[4];
+	int count = 0;
 
-	if (display_mode != ModeInvalid) {
-		src_image = pixman_image_create_bits_no_clear(PIXMAN_a8b8g8r8, image.width, image.height,
-				(uint32_t *)image.buf, image.width * 4);
-		switch (display_mode) {
-		case ModeFill: image_fill(src_image, width, height); break;
-		case ModeFit: image_fit(src_image, width, height); break;
-		case ModeStretch: image_stretch(src_image, width, height); break;
-		case ModeCenter: image_center(src_image, width, height); break;
-		case ModeTile: image_tile(src_image, width, height); break;
-		default: abort(); /* Unreachable */
-		}
-		if (!pixel_perfect)
-			pixman_image_set_filter(src_image, PIXMAN_FILTER_BEST, NULL, 0);
+	for (int i = 0; i < 4; i++)
+		if (boxes[i].x1 < boxes[i].x2 && boxes[i].y1 < boxes[i].y2)
+			visible[count++] = boxes[i];
+	if (count)
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, dst, &color, count, visible);
+}
+
+/* Picks the smallest pyramid level that still has as many pixels as the output shows of
+ * the image, so that filtering costs depend on the output size instead of the image's */
+static const struct mipmap_level *
+select_level(int width, int height)
+{
+	struct image_viewport vp;
+	double sx, sy;
+	int i = 0;
+
+	if (image.level_count > 1 &&
+			image_viewport(display_mode, image.width, image.height, width, height, &vp)) {
+		sx = vp.dst_width / vp.src_width;
+		sy = vp.dst_height / vp.src_height;
+		while (i + 1 < image.level_count && image.levels[i + 1].width >= image.width * sx &&
+				image.levels[i + 1].height >= image.height * sy)
+			i++;
 	}
+	return &image.levels[i];
+}
+
+/* A frame being drawn, shared by the stripes it is split into */
+struct frame {
+	struct jab_buffer *buffer;
+	int width, height; /* Physical size before applying transform */
+	int32_t transform;
+	const struct mipmap_level *level;
+	pixman_box32_t box;
+	const bool *cancelled; /* Set by the main thread once the frame is superseded */
 
-	surface_image = create_surface_image(shm, width, height, output->surface);
-	pixman_image_fill_rectangles(PIXMAN_OP_SRC, surface_image, &color, 1,
-			&(pixman_rectangle16_t){0, 0, width, height});
+	/* Set when the separable resampler scales the image instead of pixman. Translucent
+	 * images are scaled into the scaled pixels first and then blended. */
+	struct resample_plan *plan;
+	struct image_viewport vp;
+	uint32_t *scaled;
+
+	/* Set when rows are copied instead of composited, see plan_blit() */
+	bool blit, swap;
+	int blit_scale;
+
+	long minflt, majflt; /* Page faults taken drawing it, added to atomically */
+};
+
+/* Clips box to the rows of a stripe starting at y0 and moves it into the stripe */
+static pixman_box32_t
+stripe_box(pixman_box32_t box, int y0, int height)
+{
+	box.y1 = box.y1 - y0 < 0 ? 0 : box.y1 - y0 > height ? height : box.y1 - y0;
+	box.y2 = box.y2 - y0 < 0 ? 0 : box.y2 - y0 > height ? height : box.y2 - y0;
+	return box;
+}
+
+/* Creates the image placed and transformed for the frame. Every stripe creates its own,
+ * as pixman updates images while compositing from them. */
+static pixman_image_t *
+create_source(const struct frame *frame)
+{
+	const struct mipmap_level *level = frame->level;
+	pixman_image_t *src_image = pixman_image_create_bits_no_clear(image.format, level->width,
+			level->height, level->pixels, level->width * 4);
+
+	switch (display_mode) {
+	case ModeFill: image_fill(src_image, frame->width, frame->height); break;
+	case ModeFit: image_fit(src_image, frame->width, frame->height); break;
+	case ModeStretch: image_stretch(src_image, frame->width, frame->height); break;
+	case ModeCenter: image_center(src_image, frame->width, frame->height); break;
+	case ModeTile: image_tile(src_image, frame->width, frame->height); break;
+	case ModeInteger: image_integer(src_image, frame->width, frame->height); break;
+	default: abort(); /* Unreachable */
+	}
+	image_transform(src_image, frame->transform, frame->width, frame->height);
+	/* Integer scaling repeats pixels, which nearest filtering does exactly */
+	if (!pixel_perfect && display_mode != ModeInteger)
+		pixman_image_set_filter(src_image, PIXMAN_FILTER_BEST, NULL, 0);
+	/* Padding keeps filtered edges of opaque images opaque */
+	if (image.opaque && display_mode != ModeTile)
+		pixman_image_set_repeat(src_image, PIXMAN_REPEAT_PAD);
+	return src_image;
+}
+
+/* Sets up scaling the image with the separable resampler instead of pixman. Only the
+ * scaling modes on untransformed 32-bit buffers are handled, others keep plan unset. */
+static void
+plan_resample(struct frame *frame)
+{
+	const struct mipmap_level *level = frame->level;
+	struct image_viewport *vp = &frame->vp;
+
+	if (filter == FilterPixman || pixel_perfect || display_mode == ModeCenter ||
+			display_mode == ModeInteger ||
+			frame->transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+			(frame->buffer->format != WL_SHM_FORMAT_XRGB8888 &&
+			frame->buffer->format != WL_SHM_FORMAT_ARGB8888) ||
+			!image_viewport(display_mode, level->width, level->height,
+				frame->width, frame->height, vp))
+		return;
+
+	frame->plan = resample_plan_create(filter, level->width, level->height, vp->src_x,
+			vp->src_y, vp->src_width, vp->src_height, vp->dst_width, vp->dst_height);
+	if (!frame->plan || image.opaque)
+		return;
+	frame->scaled = malloc((size_t)vp->dst_width * vp->dst_height * sizeof *frame->scaled);
+	if (!frame->scaled) {
+		resample_plan_destroy(frame->plan);
+		frame->plan = NULL;
+	}
+}
+
+/* Draws the rows y0 up to y1 of the frame into dst with the resampler */
+static bool
+draw_resampled(const struct frame *frame, pixman_image_t *dst, int y0, int y1)
+{
+	const struct image_viewport *vp = &frame->vp;
+	const struct mipmap_level *level = frame->level;
+	const int stride = pixman_image_get_stride(frame->buffer->image) / 4;
+	/* Rows of the scaled image within the stripe */
+	const int r0 = (y0 > vp->dst_y ? y0 : vp->dst_y) - vp->dst_y;
+	const int r1 = (y1 < vp->dst_y + vp->dst_height ? y1 : vp->dst_y + vp->dst_height) -
+		vp->dst_y;
+	const pixman_box32_t box = stripe_box((pixman_box32_t){vp->dst_x, vp->dst_y,
+			vp->dst_x + vp->dst_width, vp->dst_y + vp->dst_height}, y0, y1 - y0);
+	pixman_image_t *scaled;
+
+	if (r0 >= r1) {
+		fill_background(dst, &box);
+		return true;
+	}
+
+	if (image.opaque) {
+		/* Scale straight into the buffer, the result is as opaque as the image */
+		if (!resample_rows(frame->plan, level->pixels, level->width,
+				(uint32_t *)frame->buffer->data + (size_t)vp->dst_y * stride + vp->dst_x, stride,
+				r0, r1))
+			return false;
+		fill_background(dst, &box);
+		return true;
+	}
+
+	if (!resample_rows(frame->plan, level->pixels, level->width, frame->scaled,
+			vp->dst_width, r0, r1))
+		return false;
+	scaled = pixman_image_create_bits_no_clear(PIXMAN_a8r8g8b8, vp->dst_width, r1 - r0,
+			frame->scaled + (size_t)r0 * vp->dst_width, vp->dst_width * 4);
+	fill_background(dst, &(pixman_box32_t){0});
+	pixman_image_composite32(PIXMAN_OP_OVER, scaled, NULL, dst, 0, 0, 0, 0,
+			vp->dst_x, box.y1, vp->dst_width, r1 - r0);
+	pixman_image_unref(scaled);
+	return true;
+}
+
+/* Center, tile and integer modes only copy and repeat pixels, which whole rows can do
+ * directly for opaque images on untransformed 32-bit buffers, without going through
+ * pixman */
+static void
+plan_blit(struct frame *frame)
+{
+	const struct mipmap_level *level = frame->level;
+	const uint32_t format = frame->buffer->format;
+
+	if ((display_mode != ModeCenter && display_mode != ModeTile &&
+			display_mode != ModeInteger) || !image.opaque ||
+			frame->transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		return;
+	if (format == WL_SHM_FORMAT_XBGR8888 || format == WL_SHM_FORMAT_ABGR8888)
+		frame->swap = true;
+	else if (format != WL_SHM_FORMAT_XRGB8888 && format != WL_SHM_FORMAT_ARGB8888)
+		return;
+
+	frame->blit = true;
+	frame->blit_scale = display_mode != ModeInteger ? 1 :
+		image_integer_scale(level->width, level->height, frame->width, frame->height);
+	if (display_mode != ModeTile)
+		image_viewport(display_mode, level->width, level->height, frame->width,
+				frame->height, &frame->vp);
+}
+
+/* Draws the rows y0 up to y1 of the frame into dst by copying rows */
+static void
+draw_blitted(const struct frame *frame, pixman_image_t *dst, int y0, int y1)
+{
+	const struct image_viewport *vp = &frame->vp;
+	const struct mipmap_level *level = frame->level;
+	const int stride = pixman_image_get_stride(frame->buffer->image) / 4;
+	uint32_t *row = (uint32_t *)frame->buffer->data + (size_t)y0 * stride;
+	pixman_box32_t box;
+	int y;
+
+	if (display_mode == ModeTile) {
+		/* Rows a tile further down repeat rows already drawn within the stripe */
+		for (y = y0; y < y1; y++, row += stride)
+			if (y - level->height >= y0)
+				memcpy(row, row - (size_t)level->height * stride,
+						frame->buffer->width * sizeof *row);
+			else
+				blit_tile_row(row, frame->buffer->width,
+						level->pixels + (size_t)(y % level->height) * level->width,
+						level->width, frame->swap);
+		return;
+	}
+
+	box = stripe_box((pixman_box32_t){vp->dst_x, vp->dst_y, vp->dst_x + vp->dst_width,
+			vp->dst_y + vp->dst_height}, y0, y1 - y0);
+	fill_background(dst, &box);
+	for (y = box.y1 + y0; y < box.y2 + y0; y++) {
+		uint32_t *out = (uint32_t *)frame->buffer->data + (size_t)y * stride + vp->dst_x;
+
+		/* Every source row is repeated blit_scale times, which rows already drawn in
+		 * the stripe can be copied for */
+		if (y > box.y1 + y0 && (y - vp->dst_y) % frame->blit_scale != 0)
+			memcpy(out, out - stride, vp->dst_width * sizeof *out);
+		else
+			blit_scale_row(out, level->pixels + ((size_t)vp->src_y +
+					(y - vp->dst_y) / frame->blit_scale) * level->width +
+					(int)vp->src_x, vp->dst_width / frame->blit_scale,
+					frame->blit_scale, frame->swap);
+	}
+}
+
+/* Draws the rows y0 up to y1 of the frame into dst with pixman */
+static void
+draw_composited(const struct frame *frame, pixman_image_t *dst, int y0, int y1)
+{
+	const pixman_box32_t box = stripe_box(frame->box, y0, y1 - y0);
+	pixman_image_t *src_image = create_source(frame);
+
+	if (image.opaque) {
+		/* Every pixel is written once: the background only where the image is not, and
+		 * the image without blending */
+		fill_background(dst, &box);
+		pixman_image_composite32(PIXMAN_OP_SRC, src_image, NULL, dst, box.x1, box.y1 + y0,
+				0, 0, box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+	} else {
+		fill_background(dst, &(pixman_box32_t){0});
+		pixman_image_composite32(PIXMAN_OP_OVER, src_image, NULL, dst, box.x1, box.y1 + y0,
+				0, 0, box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+	}
+	pixman_image_unref(src_image);
+}
+
+/* Reads the page faults taken by the calling thread so far. Where the system only counts
+ * them for the whole process, they read as 0. */
+static void
+thread_faults(long *minflt, long *majflt)
+{
+#ifdef RUSAGE_THREAD
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+		*minflt = usage.ru_minflt;
+		*majflt = usage.ru_majflt;
+		return;
+	}
+#endif
+	*minflt = *majflt = 0;
+}
+
+static void
+draw_stripe(void *data, int index)
+{
+	struct frame *frame = data;
+	const int y0 = index * STRIPE_HEIGHT;
+	const int y1 = y0 + STRIPE_HEIGHT < frame->buffer->height ?
+		y0 + STRIPE_HEIGHT : frame->buffer->height;
+	long minflt, majflt, start_minflt, start_majflt;
+	pixman_image_t *dst;
+
+	if (__atomic_load_n(frame->cancelled, __ATOMIC_RELAXED))
+		return;
+
+	thread_faults(&start_minflt, &start_majflt);
+	dst = buffer_create_stripe(frame->buffer, y0, y1 - y0);
+	if (display_mode == ModeInvalid)
+		fill_background(dst, &(pixman_box32_t){0});
+	else if (frame->blit)
+		draw_blitted(frame, dst, y0, y1);
+	else if (!frame->plan || !draw_resampled(frame, dst, y0, y1))
+		draw_composited(frame, dst, y0, y1);
+	pixman_image_unref(dst);
+
+	/* Stripes run on several threads at once, each counting its own */
+	thread_faults(&minflt, &majflt);
+	__atomic_add_fetch(&frame->minflt, minflt - start_minflt, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&frame->majflt, majflt - start_majflt, __ATOMIC_RELAXED);
+}
+
+/* Draws the background and image into buffer, which is width x height physical pixels
+ * before applying transform. Stripes of rows are drawn in parallel, each on its own, and
+ * the remaining ones are skipped once cancelled is set. Stores the page faults taken
+ * drawing it, which frames drawn meanwhile do not add to. */
+static void
+draw_frame(struct jab_buffer *buffer, int width, int height, int32_t transform,
+		const bool *cancelled, long *minflt, long *majflt)
+{
+	struct frame frame = {
+		.buffer = buffer, .width = width, .height = height, .transform = transform,
+		.cancelled = cancelled,
+	};
+	long start_minflt, start_majflt;
+	pixman_image_t *src_image;
+
+	thread_faults(&start_minflt, &start_majflt);
 
 	if (display_mode != ModeInvalid) {
-		pixman_image_composite32(PIXMAN_OP_OVER, src_image, NULL, surface_image,
-				0, 0, 0, 0, 0, 0, width, height);
+		frame.level = select_level(width, height);
+		plan_blit(&frame);
+		if (!frame.blit)
+			plan_resample(&frame);
+	}
+
+	if (display_mode != ModeInvalid && !frame.blit) {
+		src_image = create_source(&frame);
+		if (display_mode == ModeTile)
+			frame.box = (pixman_box32_t){0, 0, buffer->width, buffer->height};
+		else
+			image_box(src_image, buffer->width, buffer->height, &frame.box);
 		pixman_image_unref(src_image);
 	}
 
+	thread_faults(&frame.minflt, &frame.majflt);
+	frame.minflt -= start_minflt;
+	frame.majflt -= start_majflt;
+	workers_run(draw_stripe, &frame,
+			(buffer->height + STRIPE_HEIGHT - 1) / STRIPE_HEIGHT);
+	*minflt = frame.minflt;
+	*majflt = frame.majflt;
+
+	resample_plan_destroy(frame.plan);
+	free(frame.scaled);
+}
+
+/* Creates the buffer that every output's subsurface attaches, sharing the decoded image
+ * itself if possible and otherwise uploading it once */
+static bool
+create_image_buffer(void)
+{
+	const uint32_t format = image.opaque ? WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888;
+	pixman_image_t *src_image;
+
+	image_buffer = buffer_create_from(shm, image.buf, image.width, image.height, format);
+	if (image_buffer)
+		return true;
+	image_buffer = buffer_create(shm, image.width, image.height, format);
+	if (!image_buffer)
+		return false;
+
+	src_image = pixman_image_create_bits_no_clear(image.format, image.width, image.height,
+			(uint32_t *)image.buf, image.width * 4);
+	pixman_image_composite32(PIXMAN_OP_SRC, src_image, NULL, image_buffer->image,
+			0, 0, 0, 0, 0, 0, image.width, image.height);
+	pixman_image_unref(src_image);
+	return true;
+}
+
+static void
+present_image(struct jab_output *output, unsigned int width, unsigned int height)
+{
+	struct image_viewport vp;
+	wl_fixed_t x, y, w, h;
+
+	image_viewport(display_mode, image.width, image.height, width, height, &vp);
+	x = wl_fixed_from_double(vp.src_x);
+	y = wl_fixed_from_double(vp.src_y);
+	w = wl_fixed_from_double(vp.src_width);
+	h = wl_fixed_from_double(vp.src_height);
+	/* Rounding must not push the source rectangle outside of the buffer */
+	if (x + w > wl_fixed_from_int(image.width))
+		w = wl_fixed_from_int(image.width) - x;
+	if (y + h > wl_fixed_from_int(image.height))
+		h = wl_fixed_from_int(image.height) - y;
+
+	wl_subsurface_set_position(output->subsurface, vp.dst_x, vp.dst_y);
+	wp_viewport_set_source(output->image_viewport, x, y, w, h);
+	wp_viewport_set_destination(output->image_viewport, vp.dst_width, vp.dst_height);
+	wl_surface_attach(output->image_surface, image_buffer->wl_buffer, 0, 0);
+	wl_surface_damage_buffer(output->image_surface, 0, 0, image.width, image.height);
+	image_buffer->busy = true;
+	/* Applied together with the parent's next commit */
+	wl_surface_commit(output->image_surface);
+}
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct jab_output *output = data;
+
+	wl_callback_destroy(callback);
+	output->frame_callback = NULL;
+	/* The compositor is ready for the next frame, no need to wait any longer */
+	output->render_after = 0;
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done,
+};
+
+/* Attaches the job's buffer to its output and commits */
+static void
+present_frame(struct render_job *job)
+{
+	struct jab_output *output = job->output;
+
+	if (job->single_pixel) {
+		buffer_pool_drop_current(&output->pool);
+		wl_surface_attach(output->surface, job->single_pixel, 0, 0);
+		wl_surface_damage_buffer(output->surface, 0, 0, 1, 1);
+	} else {
+		buffer_pool_attach(&output->pool, job->buffer, output->surface);
+		wl_surface_damage_buffer(output->surface, 0, 0, job->buffer->width,
+				job->buffer->height);
+	}
+	wl_surface_set_buffer_transform(output->surface, job->key.transform);
+	wl_surface_set_buffer_scale(output->surface,
+			job->scale_viewport ? 1 : job->key.scale / 120);
+	if (output->viewport)
+		wp_viewport_set_destination(output->viewport,
+				job->scale_viewport ? (int)job->width : -1,
+				job->scale_viewport ? (int)job->height : -1);
+	if (output->image_surface)
+		present_image(output, job->width, job->height);
+	if (output->frame_callback)
+		wl_callback_destroy(output->frame_callback);
+	output->frame_callback = wl_surface_frame(output->surface);
+	wl_callback_add_listener(output->frame_callback, &frame_listener, output);
 	wl_surface_commit(output->surface);
-	pixman_image_unref(surface_image);
+	if (job->single_pixel)
+		wl_buffer_destroy(job->single_pixel);
+}
+
+static void
+job_free(struct render_job *job)
+{
+	if (job->buffer)
+		buffer_unref(job->buffer);
+	free(job);
+}
+
+/* Runs on a worker thread */
+static void
+draw_job(void *data, int index)
+{
+	struct render_job *job = data;
+	const double start = now_ms();
+
+	if (job->scale_color)
+		pixman_image_fill_rectangles(PIXMAN_OP_SRC, job->buffer->image, &color, 1,
+				&(pixman_rectangle16_t){0, 0, 1, 1});
+	else
+		draw_frame(job->buffer, job->phys_width, job->phys_height, job->key.transform,
+				&job->cancelled, &job->minflt, &job->majflt);
+	job->time = now_ms() - start;
+}
+
+/* Renders output again a little later, when rendering failed for lack of memory */
+static void
+output_retry(struct jab_output *output)
+{
+	output->dirty = true;
+	output->render_after = now_ms() + RETRY_MS;
+}
+
+/* Sets up the next frame of output. Frames that need no drawing are presented right
+ * away, others become the output's job until they have been drawn. */
+static void
+render_frame(struct jab_output *output)
+{
+	const unsigned int width = output->width, height = output->height;
+	/* The surface only shows the colour when there is no image or the image is presented
+	 * by a subsurface, and then a single pixel is enough if the compositor can scale it */
+	const bool scale_color = output->viewport &&
+		(display_mode == ModeInvalid || output->image_surface);
+	/* Render pre-rotated so the compositor can scan the buffer out without a rotation
+	 * pass. Rotating a single pixel is pointless. */
+	const int32_t transform = scale_color ? WL_OUTPUT_TRANSFORM_NORMAL : output->transform;
+	const bool rotated = transform & WL_OUTPUT_TRANSFORM_90;
+	/* Render at physical resolution. Fractional scales are presented by setting the
+	 * viewport destination to the logical size, integer ones by the buffer scale. */
+	const uint32_t scale = scale_color ? 120 : output_scale(output);
+	const unsigned int phys_width = (width * scale + 60) / 120;
+	const unsigned int phys_height = (height * scale + 60) / 120;
+	const unsigned int buffer_width = scale_color ? 1 : rotated ? phys_height : phys_width;
+	const unsigned int buffer_height = scale_color ? 1 : rotated ? phys_width : phys_height;
+	struct jab_buffer *buffer;
+	struct render_job *job = calloc(1, sizeof *job);
+
+	if (!job)
+		return output_retry(output);
+	*job = (struct render_job){
+		.output = output, .generation = output->generation, .scale_color = scale_color,
+		.width = width, .height = height, .phys_width = phys_width,
+		.phys_height = phys_height, .scale_viewport = scale_color || output->fractional_scale,
+		.key = {
+			.width = buffer_width, .height = buffer_height, .format = shm_format,
+			.scale = scale, .transform = transform,
+			.mode = scale_color ? ModeInvalid : display_mode,
+			.filter = pixel_perfect ? -1 : filter,
+			.image = scale_color ? NULL : image.buf, .color = color,
+		},
+	};
+
+	if (scale_color && single_pixel_buffer_manager) {
+		job->single_pixel = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+				single_pixel_buffer_manager, color.red * 0x10001u,
+				color.green * 0x10001u, color.blue * 0x10001u, color.alpha * 0x10001u);
+		present_frame(job);
+		return job_free(job);
+	}
+
+	/* An opaque image the size of the buffer is shown as is in every mode, and is already
+	 * in a shareable 32-bit format */
+	if (!scale_color && image.buf && image.opaque && transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+			buffer_width == (unsigned int)image.width &&
+			buffer_height == (unsigned int)image.height &&
+			(shm_format == WL_SHM_FORMAT_XRGB8888 || shm_format == WL_SHM_FORMAT_ARGB8888) &&
+			(image_buffer || create_image_buffer())) {
+		log_debug("%s: presenting the decoded image without drawing", output->name);
+		job->buffer = buffer_ref(image_buffer);
+		present_frame(job);
+		return job_free(job);
+	}
+
+	buffer = find_shared_buffer(&job->key);
+	if (buffer) {
+		log_debug("%s: sharing buffer with another output", output->name);
+		job->buffer = buffer_ref(buffer);
+		present_frame(job);
+		return job_free(job);
+	}
+	/* Or wait for another output's frame that is still being drawn */
+	tll_foreach(outputs, it) {
+		struct render_job *other = it->item.job;
+		if (other && other->draw && !other->cancelled &&
+				buffer_key_equal(&other->key, &job->key)) {
+			log_debug("%s: sharing buffer with %s", output->name, it->item.name);
+			job->buffer = buffer_ref(other->buffer);
+			job->sharing = other->sharing;
+			other->sharing = job;
+			output->job = job;
+			return;
+		}
+	}
+
+	buffer = buffer_pool_get(&output->pool, shm, buffer_width, buffer_height, shm_format);
+	if (!buffer) {
+		/* If the compositor holds every buffer, releasing one renders the output again */
+		if (!output->pool.waiting)
+			output_retry(output);
+		return job_free(job);
+	}
+	job->buffer = buffer_ref(buffer);
+	job->draw = true;
+	if (!workers_submit(draw_job, job)) {
+		output_retry(output);
+		return job_free(job);
+	}
+	output->job = job;
+}
+
+/* Starts rendering every dirty output that is due and has no frame being drawn already.
+ * A frame that was superseded meanwhile is cancelled and the output rendered once it is
+ * done. */
+static void
+render_outputs(void)
+{
+	const double now = now_ms();
+
+	tll_foreach(outputs, it) {
+		if (!it->item.dirty || it->item.job || it->item.render_after > now ||
+				!it->item.layer_surface)
+			continue;
+		it->item.dirty = false;
+		render_frame(&it->item);
+	}
+}
+
+/* Returns the milliseconds until the next dirty output is due, or -1 if none is waiting */
+static int
+render_timeout(void)
+{
+	const double now = now_ms();
+	double next = INFINITY;
+
+	tll_foreach(outputs, it)
+		if (it->item.dirty && !it->item.job && it->item.layer_surface &&
+				it->item.render_after < next)
+			next = it->item.render_after;
+	if (next == INFINITY)
+		return -1;
+	return next > now ? ceil(next - now) : 0;
+}
+
+/* Presents the frames that have been drawn, unless they were superseded meanwhile */
+static void
+collect_frames(void)
+{
+	struct render_job *job, *next;
+	bool drawn;
+
+	while ((job = workers_collect())) {
+		/* Cancelled frames skipped drawing stripes, sharing them is out of question */
+		drawn = !job->cancelled;
+		if (drawn) {
+			job->buffer->key = job->key;
+			job->buffer->key_valid = true;
+			log_debug("%s: rendered %dx%d in %.3f ms, %ld minor and %ld major page faults",
+					job->output ? job->output->name : "removed output",
+					job->buffer->width, job->buffer->height, job->time,
+					job->minflt, job->majflt);
+		}
+
+		for (; job; job = next) {
+			next = job->sharing;
+			if (job->output) {
+				job->output->job = NULL;
+				if (drawn && job->generation == job->output->generation)
+					present_frame(job);
+				else
+					job->output->dirty = true;
+			}
+			job_free(job);
+		}
+	}
+}
+
+/* Marks output for rendering, superseding the frame still being drawn for it. Outputs
+ * without a surface have nothing to render into. */
+static void
+output_invalidate(struct jab_output *output)
+{
+	if (!output->layer_surface)
+		return;
+	output->dirty = true;
+	output->render_after = now_ms() + coalesce_ms;
+	output->generation++;
+	if (output->job)
+		__atomic_store_n(&output->job->cancelled, true, __ATOMIC_RELAXED);
 }
 
 static void
@@ -146,6 +969,7 @@ layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *layer_surface,
 		uint32_t width, uint32_t height)
 {
 	struct jab_output *output = data;
+	const bool first = output->width == 0;
 
 	if (output->width == width && output->height == height)
 		return;
@@ -154,7 +978,10 @@ layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *layer_surface,
 	output->height = height;
 	output->configure_serial = serial;
 	output->needs_ack = true;
-	output->dirty = true;
+	output_invalidate(output);
+	/* Nothing is shown until the first frame, so there is nothing to wait for */
+	if (first)
+		output->render_after = 0;
 }
 
 static void
@@ -171,18 +998,64 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
     .closed = layer_surface_closed,
 };
 
+static void
+fractional_scale_preferred_scale(void *data, struct wp_fractional_scale_v1 *fractional_scale,
+		uint32_t scale)
+{
+	struct jab_output *output = data;
+
+	if (output->preferred_scale == scale)
+		return;
+
+	if (output->width && output->height && output_scale(output) != scale)
+		output_invalidate(output);
+	output->preferred_scale = scale;
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = fractional_scale_preferred_scale,
+};
+
 /* TODO: rename */
 static void
 add_surface_to_output(struct jab_output *output)
 {
-	struct wl_region *input_region;
+	struct wl_region *input_region, *opaque_region;
 
 	output->surface = wl_compositor_create_surface(compositor);
 
 	/* passthrough input */
 	input_region = wl_compositor_create_region(compositor);
 	wl_surface_set_input_region(output->surface, input_region);
+
+	/* The background is drawn in XRGB or as an opaque colour, so nothing below it can
+	 * show through. The same goes for the image subsurface unless the image has alpha. */
+	opaque_region = wl_compositor_create_region(compositor);
+	wl_region_add(opaque_region, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_set_opaque_region(output->surface, opaque_region);
+
+	if (viewporter)
+		output->viewport = wp_viewporter_get_viewport(viewporter, output->surface);
+
+	if (viewporter && fractional_scale_manager) {
+		output->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
+				fractional_scale_manager, output->surface);
+		wp_fractional_scale_v1_add_listener(output->fractional_scale,
+				&fractional_scale_listener, output);
+	}
+
+	if (compositor_scaling) {
+		output->image_surface = wl_compositor_create_surface(compositor);
+		wl_surface_set_input_region(output->image_surface, input_region);
+		if (image.opaque)
+			wl_surface_set_opaque_region(output->image_surface, opaque_region);
+		output->subsurface = wl_subcompositor_get_subsurface(subcompositor,
+				output->image_surface, output->surface);
+		output->image_viewport = wp_viewporter_get_viewport(viewporter, output->image_surface);
+	}
+
 	wl_region_destroy(input_region);
+	wl_region_destroy(opaque_region);
 
 	output->layer_surface = zwlr_layer_shell_v1_get_layer_surface(layer_shell, output->surface,
 			output->wl_output, ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, "background");
@@ -195,11 +1068,53 @@ add_surface_to_output(struct jab_output *output)
 	wl_surface_commit(output->surface);
 }
 
+static void
+output_geometry(void *data, struct wl_output *wl_output, int32_t x, int32_t y,
+		int32_t physical_width, int32_t physical_height, int32_t subpixel, const char *make,
+		const char *model, int32_t transform)
+{
+	struct jab_output *output = data;
+
+	if (output->transform == transform)
+		return;
+
+	output->transform = transform;
+	/* Rotations also change the surface size and bring a configure, flips do not */
+	if (output->width && output->height)
+		output_invalidate(output);
+}
+
+static void
+output_mode(void *data, struct wl_output *wl_output, uint32_t flags, int32_t width,
+		int32_t height, int32_t refresh)
+{
+	struct jab_output *output = data;
+
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		output->mode_width = width;
+		output->mode_height = height;
+	}
+}
+
+static void
+output_scale_event(void *data, struct wl_output *wl_output, int32_t factor)
+{
+	struct jab_output *output = data;
+
+	if (output->scale == factor)
+		return;
+
+	output->scale = factor;
+	/* The fractional scale takes precedence once the compositor has sent one */
+	if (output->width && output->height && !(output->fractional_scale && output->preferred_scale))
+		output_invalidate(output);
+}
+
 static void
 output_done(void *data, struct wl_output *wl_output)
 {
 	struct jab_output *output = data;
-	if (!output->layer_surface)
+	if (running && !output->layer_surface)
 		add_surface_to_output(output);
 }
 
@@ -230,14 +1145,32 @@ output_description(void *data, struct wl_output *wl_output, const char *descript
 }
 
 static const struct wl_output_listener output_listener = {
-	.geometry = noop,
-	.mode = noop,
+	.geometry = output_geometry,
+	.mode = output_mode,
 	.done = output_done,
-	.scale = noop,
+	.scale = output_scale_event,
 	.name = output_name,
 	.description = output_description,
 };
 
+/* The compositor released a buffer that render_frame() found held */
+static void
+output_buffer_released(void *data)
+{
+	struct jab_output *output = data;
+	output->dirty = true;
+}
+
+static void
+shm_format_event(void *data, struct wl_shm *wl_shm, uint32_t format)
+{
+	tll_push_back(shm_formats, format);
+}
+
+static const struct wl_shm_listener shm_listener = {
+	.format = shm_format_event,
+};
+
 static void
 registry_global(void *data, struct wl_registry *registry, uint32_t name, const char *interface,
 		uint32_t version)
@@ -247,17 +1180,35 @@ registry_global(void *data, struct wl_registry *registry, uint32_t name, const c
 	if (strcmp(interface, wl_compositor_interface.name) == 0)
 		compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 4);
 
-	else if (strcmp(interface, wl_shm_interface.name) == 0)
+	else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+		wl_shm_add_listener(shm, &shm_listener, NULL);
+	}
 
 	else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0)
 		layer_shell = wl_registry_bind(registry, name, &zwlr_layer_shell_v1_interface, 2);
 
+	else if (strcmp(interface, wl_subcompositor_interface.name) == 0)
+		subcompositor = wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
+
+	else if (strcmp(interface, wp_viewporter_interface.name) == 0)
+		viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface, 1);
+
+	else if (strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name) == 0)
+		single_pixel_buffer_manager = wl_registry_bind(registry, name,
+				&wp_single_pixel_buffer_manager_v1_interface, 1);
+
+	else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0)
+		fractional_scale_manager = wl_registry_bind(registry, name,
+				&wp_fractional_scale_manager_v1_interface, 1);
+
 	else if (strcmp(interface, wl_output_interface.name) == 0) {
 		tll_push_back(outputs, ((struct jab_output){
 					.wl_output = wl_registry_bind(registry, name, &wl_output_interface, 4),
-					.wl_name = name }));
+					.wl_name = name, .scale = 1 }));
 		output = &tll_back(outputs);
+		output->pool.release = output_buffer_released;
+		output->pool.data = output;
 		wl_output_add_listener(output->wl_output, &output_listener, output);
 	}
 }
@@ -265,9 +1216,13 @@ registry_global(void *data, struct wl_registry *registry, uint32_t name, const c
 static void
 registry_global_remove(void *data, struct wl_registry *registry, uint32_t name)
 {
-	tll_foreach(outputs, it)
-		if (it->item.wl_name == name)
-			return jab_output_destroy(&it->item);
+	tll_foreach(outputs, it) {
+		if (it->item.wl_name == name) {
+			jab_output_destroy(&it->item);
+			tll_remove(outputs, it);
+			return;
+		}
+	}
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -275,13 +1230,74 @@ static const struct wl_registry_listener registry_listener = {
 	.global_remove = registry_global_remove,
 };
 
+/* Finds the smallest size the image can be decoded at without any current output showing
+ * it enlarged. Outputs appearing later may show it enlarged. */
+static void
+decode_size(int width, int height, int *min_width, int *min_height)
+{
+	struct image_viewport vp;
+	int w, h;
+
+	*min_width = *min_height = 0;
+	tll_foreach(outputs, it) {
+		const bool rotated = it->item.transform & WL_OUTPUT_TRANSFORM_90;
+		w = rotated ? it->item.mode_height : it->item.mode_width;
+		h = rotated ? it->item.mode_width : it->item.mode_height;
+		/* Modes that keep pixels as they are, or that -p renders exactly, need them all */
+		if (pixel_perfect || w <= 0 || h <= 0 ||
+				!image_viewport(display_mode, width, height, w, h, &vp)) {
+			*min_width = width;
+			*min_height = height;
+			return;
+		}
+		w = ceil(width * vp.dst_width / vp.src_width);
+		h = ceil(height * vp.dst_height / vp.src_height);
+		if (w > *min_width)
+			*min_width = w;
+		if (h > *min_height)
+			*min_height = h;
+	}
+	if (!*min_width || !*min_height) {
+		*min_width = width;
+		*min_height = height;
+	}
+}
+
+/* Decodes the image, scaled down to the outputs if the decoder can */
+static bool
+load_image(void)
+{
+	struct input input;
+	int min_width, min_height;
+
+	if (!input_open(&input, image_path))
+		return false;
+	if (decode_info(input.data, input.size, &image.width, &image.height))
+		decode_size(image.width, image.height, &min_width, &min_height);
+	else
+		min_width = min_height = INT_MAX;
+	/* Converted while decoding to what we render into, so compositing never has to
+	 * swizzle */
+	image.buf = (unsigned char *)decode_image(input.data, input.size, min_width, min_height,
+			&image.width, &image.height, &image.opaque);
+	input_close(&input);
+	if (!image.buf)
+		return false;
+	image.format = image.opaque ? PIXMAN_x8r8g8b8 : PIXMAN_a8r8g8b8;
+	image.levels[0] = (struct mipmap_level){(uint32_t *)image.buf, image.width, image.height};
+	image.level_count = 1;
+	return true;
+}
+
 int
 main(int argc, char *argv[])
 {
 	int ret = EXIT_FAILURE, c;
+	char *end;
+	struct pollfd fds[2];
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, "hVpc:i:m:")) != -1)
+	while ((c = getopt(argc, argv, "hVpPsvc:d:f:F:i:m:t:")) != -1)
 		switch (c) {
 			case 'h':
 				fputs(usage, stderr);
@@ -292,15 +1308,36 @@ main(int argc, char *argv[])
 			case 'p':
 				pixel_perfect = true;
 				break;
+			case 'P':
+				buffer_set_prefault(false);
+				break;
+			case 's':
+				compositor_scaling = true;
+				break;
+			case 'v':
+				log_set_verbose(true);
+				break;
 			case 'c':
 				if (!parse_pixman_color(optarg, &color)) {
 					fprintf(stderr, "jab: failed to parse color\n");
 					exit(EXIT_FAILURE);
 				}
 				break;
+			case 'f':
+				if (!parse_format(optarg)) {
+					fprintf(stderr, "jab: failed to parse format\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'F':
+				filter = parse_filter(optarg);
+				if (filter == -1) {
+					fprintf(stderr, "jab: failed to parse filter\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'i':
-				strncpy(image_path, optarg, sizeof image_path);
-				image_path[sizeof image_path - 1] = '\0';
+				image_path = optarg;
 				break;
 			case 'm':
 				display_mode = parse_display_mode(optarg);
@@ -309,8 +1346,23 @@ main(int argc, char *argv[])
 					exit(EXIT_FAILURE);
 				}
 				break;
+			case 'd':
+				coalesce_ms = strtol(optarg, &end, 10);
+				if (*end != '\0' || coalesce_ms < 0) {
+					fprintf(stderr, "jab: failed to parse delay\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 't':
+				threads = strtol(optarg, &end, 10);
+				if (*end != '\0' || threads < 1) {
+					fprintf(stderr, "jab: failed to parse thread count\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case '?':
-				if (optopt == 'c' || optopt == 'i' || optopt == 'm')
+				if (optopt == 'c' || optopt == 'd' || optopt == 'f' || optopt == 'F' ||
+						optopt == 'i' || optopt == 'm' || optopt == 't')
 					fprintf(stderr, "jab: option requires argument -- '%c'\n", optopt);
 				else
 					fprintf(stderr, "jab: unknown option -- '%c'\n", optopt);
@@ -320,11 +1372,13 @@ main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 		}
 
-	if (display_mode != ModeInvalid && image_path[0] != '\0')
-		if ((image.buf = stbi_load(image_path, &image.width, &image.height, NULL, 4)) == NULL) {
-			fprintf(stderr, "jab: failed to load image: %s\n", stbi_failure_reason());
-			goto finish;
-		}
+	if (threads == 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!workers_init(threads > 0 ? threads : 1)) {
+		fputs("jab: failed to start workers\n", stderr);
+		goto finish;
+	}
+	log_debug("drawing with %d threads", workers_count());
 
 	display = wl_display_connect(NULL);
 	if (!display) {
@@ -341,29 +1395,105 @@ main(int argc, char *argv[])
 		goto finish;
 	}
 
+	/* Settled before any output gets a surface, which only has an image subsurface if this
+	 * is set */
+	if (compositor_scaling) {
+		/* Tiling needs more than one viewport, and the compositor picks its own filter,
+		 * which neither -p nor integer scaling can rely on */
+		compositor_scaling = viewporter && subcompositor && display_mode != ModeInvalid &&
+			display_mode != ModeTile && display_mode != ModeInteger && !pixel_perfect;
+		if (!compositor_scaling)
+			fputs("jab: compositor scaling unavailable, scaling images locally\n", stderr);
+	}
+
+	/* Collect the formats announced on binding wl_shm, and the outputs' modes */
+	wl_display_roundtrip(display);
+	if (display_mode != ModeInvalid && image_path && !load_image())
+		goto finish;
+	shm_format = choose_format();
+	log_debug("rendering with format 0x%08x", shm_format);
+	if (filter != FilterPixman)
+		log_debug("resampling with %s kernels", resample_isa());
+
+	if (compositor_scaling && !create_image_buffer())
+		goto finish;
+
+	/* Only downscaling modes benefit from the pyramid, which -p and -s bypass */
+	if (!compositor_scaling && !pixel_perfect && (display_mode == ModeFill ||
+			display_mode == ModeFit || display_mode == ModeStretch)) {
+		double start = now_ms();
+		image.level_count = mipmap_build(image.levels);
+		log_debug("built %d pyramid levels in %.3f ms", image.level_count, now_ms() - start);
+	}
+
+	fds[0] = (struct pollfd){wl_display_get_fd(display), POLLIN, 0};
+	fds[1] = (struct pollfd){workers_fd(), POLLIN, 0};
+
+	/* Outputs get their surfaces once the image is ready, and then as they appear */
+	tll_foreach(outputs, it)
+		if (!it->item.layer_surface)
+			add_surface_to_output(&it->item);
+
 	ret = EXIT_SUCCESS;
 	running = true;
-	while (running && wl_display_dispatch(display) != -1) {
-		wl_display_flush(display);
+	while (running) {
+		if (wl_display_dispatch_pending(display) == -1)
+			break;
 		tll_foreach(outputs, it) {
 			if (it->item.needs_ack) {
 				it->item.needs_ack = false;
 				zwlr_layer_surface_v1_ack_configure(it->item.layer_surface,
 						it->item.configure_serial);
 			}
-			if (it->item.dirty) {
-				it->item.dirty = false;
-				render_frame(&it->item, it->item.width, it->item.height);
-			}
 		}
+		render_outputs();
+
+		/* Frames are drawn on the workers while events keep being read, so that a
+		 * configure arriving meanwhile cancels the frame it supersedes. Dirty outputs
+		 * wake the loop once they are due. */
+		if (wl_display_prepare_read(display) != 0)
+			continue;
+		wl_display_flush(display);
+		if (poll(fds, 2, render_timeout()) == -1) {
+			wl_display_cancel_read(display);
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			if (wl_display_read_events(display) == -1)
+				break;
+		} else {
+			wl_display_cancel_read(display);
+		}
+		if (fds[0].revents & (POLLERR | POLLHUP))
+			break;
+		if (fds[1].revents & POLLIN)
+			collect_frames();
 	}
 
 finish:
 	tll_foreach(outputs, it)
 		jab_output_destroy(&it->item);
 	tll_free(outputs);
+	/* Frames still being drawn are cancelled and only need freeing */
+	workers_finish();
+	collect_frames();
+	if (image_buffer)
+		buffer_unref(image_buffer);
+	mipmap_finish(image.levels, image.level_count);
+	buffer_free(image.buf);
+	if (single_pixel_buffer_manager)
+		wp_single_pixel_buffer_manager_v1_destroy(single_pixel_buffer_manager);
+	if (fractional_scale_manager)
+		wp_fractional_scale_manager_v1_destroy(fractional_scale_manager);
+	if (viewporter)
+		wp_viewporter_destroy(viewporter);
+	if (subcompositor)
+		wl_subcompositor_destroy(subcompositor);
 	if (layer_shell)
 		zwlr_layer_shell_v1_destroy(layer_shell);
+	tll_free(shm_formats);
 	if (shm)
 		wl_shm_destroy(shm);
 	if (compositor)
@@ -0,0 +1,531 @@
+#include "decode.h"
+
+#ifdef HAVE_LIBJPEG
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#include "buffer.h"
+#include "log.h"
+#include "workers.h"
+
+struct error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+	char message[JMSG_LENGTH_MAX];
+};
+
+/* Where the scan of a baseline image with restart markers can be entered, for decoding
+ * it in bands on the workers. Rows are MCU rows. */
+struct bands {
+	struct decode *decode;
+	int scale_denom;
+	size_t sof; /* Offset of the image height in the frame header */
+	size_t scan; /* Offset of the entropy-coded data */
+	size_t *markers; /* Offsets of the restart markers in the entropy-coded data */
+	size_t marker_count;
+	int restart_interval; /* In MCUs */
+	int mcu_columns, mcu_rows, mcu_height;
+	int period; /* Rows between those that start with a restart marker */
+	int count; /* Bands to decode */
+	bool failed, transparent; /* Written by the workers atomically */
+};
+
+/* Feeds libjpeg a copy of the headers with a changed image height, followed by the scan
+ * from one of its restart markers on. The markers are renumbered to start from 0. */
+struct source {
+	struct jpeg_source_mgr mgr;
+	const struct bands *bands;
+	size_t pos, next_marker; /* In the original data */
+	unsigned int restart;
+	JOCTET marker[2];
+};
+
+/* Collects the image written by jpeg_load_transcoded() in memory growing as needed */
+struct destination {
+	struct jpeg_destination_mgr mgr;
+	unsigned char *data;
+	size_t size;
+};
+
+static void
+error_exit(j_common_ptr cinfo)
+{
+	struct error *error = (struct error *)cinfo->err;
+
+	(*cinfo->err->format_message)(cinfo, error->message);
+	longjmp(error->jump, 1);
+}
+
+static void
+output_message(j_common_ptr cinfo)
+{
+	char message[JMSG_LENGTH_MAX];
+
+	(*cinfo->err->format_message)(cinfo, message);
+	log_debug("libjpeg: %s", message);
+}
+
+static void
+source_init(j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+source_fill(j_decompress_ptr cinfo)
+{
+	static const JOCTET eoi[] = {0xff, JPEG_EOI};
+	struct source *src = (struct source *)cinfo->src;
+	const struct bands *bands = src->bands;
+	const size_t size = bands->decode->size;
+	size_t end;
+
+	if (src->pos >= size) {
+		/* Like jpeg_mem_src(), end the image if libjpeg reads past it */
+		src->mgr.next_input_byte = eoi;
+		src->mgr.bytes_in_buffer = sizeof eoi;
+	} else if (src->next_marker < bands->marker_count &&
+			src->pos == bands->markers[src->next_marker]) {
+		src->marker[0] = 0xff;
+		src->marker[1] = JPEG_RST0 + (src->restart++ & 7);
+		src->mgr.next_input_byte = src->marker;
+		src->mgr.bytes_in_buffer = sizeof src->marker;
+		src->pos += 2;
+		src->next_marker++;
+	} else {
+		end = src->next_marker < bands->marker_count ?
+			bands->markers[src->next_marker] : size;
+		src->mgr.next_input_byte = bands->decode->data + src->pos;
+		src->mgr.bytes_in_buffer = end - src->pos;
+		src->pos = end;
+	}
+	return TRUE;
+}
+
+static void
+source_skip(j_decompress_ptr cinfo, long count)
+{
+	struct jpeg_source_mgr *src = cinfo->src;
+
+	while (count > (long)src->bytes_in_buffer) {
+		count -= src->bytes_in_buffer;
+		source_fill(cinfo);
+	}
+	src->next_input_byte += count;
+	src->bytes_in_buffer -= count;
+}
+
+static void
+source_term(j_decompress_ptr cinfo)
+{
+}
+
+static void
+destination_init(j_compress_ptr cinfo)
+{
+}
+
+static boolean
+destination_empty(j_compress_ptr cinfo)
+{
+	struct destination *dest = (struct destination *)cinfo->dest;
+	struct error *error = (struct error *)cinfo->err;
+	unsigned char *data = realloc(dest->data, dest->size * 2);
+
+	if (!data) {
+		strcpy(error->message, "out of memory");
+		longjmp(error->jump, 1);
+	}
+	dest->mgr.next_output_byte = data + dest->size;
+	dest->mgr.free_in_buffer = dest->size;
+	dest->data = data;
+	dest->size *= 2;
+	return TRUE;
+}
+
+static void
+destination_term(j_compress_ptr cinfo)
+{
+}
+
+/* Finds the frame header, the scan and its restart markers. Returns false unless the
+ * image is a single baseline scan whose restart markers are all there. */
+static bool
+bands_parse(struct bands *bands, struct jpeg_decompress_struct *cinfo)
+{
+	const unsigned char *data = bands->decode->data;
+	const size_t size = bands->decode->size;
+	const int components = cinfo->num_components;
+	size_t pos = 2, intervals, *markers;
+	const unsigned char *p;
+
+	if (cinfo->progressive_mode || jpeg_has_multiple_scans(cinfo) ||
+			cinfo->restart_interval == 0)
+		return false;
+
+	bands->sof = bands->scan = 0;
+	while (!bands->scan) {
+		if (pos + 4 > size || data[pos] != 0xff)
+			return false;
+		if (data[pos + 1] == 0xff) {
+			pos++;
+			continue;
+		}
+		if (data[pos + 1] == 0xc0 || data[pos + 1] == 0xc1)
+			bands->sof = pos + 5;
+		else if (data[pos + 1] == 0xda)
+			bands->scan = pos + 2 + (data[pos + 2] << 8 | data[pos + 3]);
+		pos += 2 + (data[pos + 2] << 8 | data[pos + 3]);
+	}
+	if (!bands->sof || bands->scan > size)
+		return false;
+
+	/* A scan of one component codes single blocks, otherwise blocks of every component
+	 * interleaved */
+	bands->restart_interval = cinfo->restart_interval;
+	bands->mcu_height = components == 1 ? DCTSIZE : DCTSIZE * cinfo->max_v_samp_factor;
+	bands->mcu_columns = (cinfo->image_width + (components == 1 ? DCTSIZE :
+			DCTSIZE * cinfo->max_h_samp_factor) - 1) /
+		(components == 1 ? DCTSIZE : DCTSIZE * cinfo->max_h_samp_factor);
+	bands->mcu_rows = (cinfo->image_height + bands->mcu_height - 1) / bands->mcu_height;
+	intervals = ((size_t)bands->mcu_columns * bands->mcu_rows + bands->restart_interval - 1) /
+		bands->restart_interval;
+
+	/* Restart markers can only show up as themselves, any other 0xff is followed by a
+	 * stuffed 0 or is a marker ending the scan */
+	bands->marker_count = 0;
+	for (pos = bands->scan; bands->marker_count + 1 < intervals; pos += 2) {
+		p = memchr(data + pos, 0xff, size - pos);
+		if (!p || p + 1 >= data + size)
+			return false;
+		pos = p - data;
+		if (data[pos + 1] == 0)
+			continue;
+		if (data[pos + 1] == 0xff) {
+			pos--;
+			continue;
+		}
+		if (data[pos + 1] < JPEG_RST0 || data[pos + 1] > JPEG_RST0 + 7)
+			return false;
+		if (bands->marker_count % 1024 == 0) {
+			markers = realloc(bands->markers,
+					(bands->marker_count + 1024) * sizeof *markers);
+			if (!markers)
+				return false;
+			bands->markers = markers;
+		}
+		bands->markers[bands->marker_count++] = pos;
+	}
+	return true;
+}
+
+/* Row of the first MCU row of band index, which starts with a restart marker */
+static int
+band_row(const struct bands *bands, int index)
+{
+	const int starts = (bands->mcu_rows + bands->period - 1) / bands->period;
+	const int row = (long long)starts * index / bands->count * bands->period;
+
+	return row < bands->mcu_rows ? row : bands->mcu_rows;
+}
+
+/* Runs on a worker thread */
+static void
+load_band(void *data, int index)
+{
+	struct bands *bands = data;
+	struct decode *decode = bands->decode;
+	const int row = band_row(bands, index), end = band_row(bands, index + 1);
+	/* Start one period early, so that upsampling at the first row sees the same rows
+	 * above as when decoding the whole image, and throw the rows before away */
+	const int start = row > 0 ? row - bands->period : 0;
+	const int band_height = bands->mcu_height / bands->scale_denom;
+	const size_t interval = (size_t)start * bands->mcu_columns / bands->restart_interval;
+	struct jpeg_decompress_struct cinfo;
+	struct error error;
+	struct source src = {0};
+	JOCTET *volatile header = NULL;
+	unsigned char *volatile skipped = NULL;
+	unsigned int height, y0, y1;
+	JSAMPROW out;
+
+	if (row == end)
+		return;
+
+	cinfo.err = jpeg_std_error(&error.mgr);
+	error.mgr.error_exit = error_exit;
+	error.mgr.output_message = output_message;
+	if (setjmp(error.jump)) {
+		log_debug("libjpeg: band %d: %s", index, error.message);
+		__atomic_store_n(&bands->failed, true, __ATOMIC_RELAXED);
+		jpeg_destroy_decompress(&cinfo);
+		free(header);
+		free(skipped);
+		return;
+	}
+	jpeg_create_decompress(&cinfo);
+
+	header = malloc(bands->scan);
+	if (!header) {
+		strcpy(error.message, "out of memory");
+		longjmp(error.jump, 1);
+	}
+	memcpy(header, decode->data, bands->scan);
+	height = ((unsigned int)header[bands->sof] << 8 | header[bands->sof + 1]) -
+		start * bands->mcu_height;
+	header[bands->sof] = height >> 8;
+	header[bands->sof + 1] = height;
+
+	src.mgr.init_source = source_init;
+	src.mgr.fill_input_buffer = source_fill;
+	src.mgr.skip_input_data = source_skip;
+	src.mgr.resync_to_restart = jpeg_resync_to_restart;
+	src.mgr.term_source = source_term;
+	src.mgr.next_input_byte = header;
+	src.mgr.bytes_in_buffer = bands->scan;
+	src.bands = bands;
+	src.pos = interval == 0 ? bands->scan : bands->markers[interval - 1] + 2;
+	src.next_marker = interval;
+	cinfo.src = &src.mgr;
+
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_EXT_RGBA;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = bands->scale_denom;
+	jpeg_start_decompress(&cinfo);
+
+	skipped = malloc((size_t)cinfo.output_width * 4);
+	if (!skipped) {
+		strcpy(error.message, "out of memory");
+		longjmp(error.jump, 1);
+	}
+	out = skipped;
+	while (cinfo.output_scanline < (unsigned int)(row - start) * band_height)
+		jpeg_read_scanlines(&cinfo, &out, 1);
+
+	y0 = row * band_height;
+	y1 = (unsigned int)end * band_height < (unsigned int)decode->height ?
+		(unsigned int)end * band_height : (unsigned int)decode->height;
+	while (cinfo.output_scanline < y1 - start * band_height) {
+		out = decode->pixels + ((size_t)start * band_height + cinfo.output_scanline) *
+			decode->width * 4;
+		jpeg_read_scanlines(&cinfo, &out, 1);
+	}
+	if (!decode_band(decode, y0, y1))
+		__atomic_store_n(&bands->transparent, true, __ATOMIC_RELAXED);
+
+	/* The rest of the scan belongs to other bands */
+	jpeg_abort_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free(header);
+	free(skipped);
+}
+
+/* Decodes a baseline image with restart markers in bands on the workers, each entering
+ * the scan at a restart marker, with the same result as decoding it in one go */
+static bool
+jpeg_load_bands(struct decode *decode, struct jpeg_decompress_struct *cinfo)
+{
+	struct bands bands = {.decode = decode, .scale_denom = cinfo->scale_denom};
+	int a, b;
+
+	if (workers_count() < 2 || !bands_parse(&bands, cinfo))
+		goto fail;
+
+	/* Rows starting with a restart marker come every so many rows */
+	for (a = bands.restart_interval, b = bands.mcu_columns; b; ) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	bands.period = bands.restart_interval / a;
+	bands.count = (bands.mcu_rows + bands.period - 1) / bands.period;
+	if (bands.count > workers_count())
+		bands.count = workers_count();
+	if (bands.count < 2)
+		goto fail;
+
+	decode->width = cinfo->output_width;
+	decode->height = cinfo->output_height;
+	decode->pixels = buffer_alloc((size_t)decode->width * decode->height * 4, true);
+	if (!decode->pixels)
+		goto fail;
+	workers_run(load_band, &bands, bands.count);
+	if (bands.failed) {
+		buffer_free(decode->pixels);
+		decode->pixels = NULL;
+		goto fail;
+	}
+	decode->rows_done = decode->height;
+	decode->opaque = !bands.transparent;
+
+	log_debug("libjpeg: decoded in %d bands", bands.count);
+	free(bands.markers);
+	return true;
+
+fail:
+	free(bands.markers);
+	return false;
+}
+
+/* Without restart markers, the scan can only be entropy decoded from its start. Does that
+ * here and writes the coefficients back out as a baseline image with a restart marker
+ * at every MCU row, which the workers then decode in bands, doing the IDCT, upsampling
+ * and colour conversion. The coefficients stay the same, and so do the pixels. */
+static bool
+jpeg_load_transcoded(struct decode *decode, const struct jpeg_decompress_struct *header)
+{
+	struct jpeg_decompress_struct src = {0}, cinfo = {0};
+	struct jpeg_compress_struct dst = {0};
+	struct error error;
+	struct destination dest = {0};
+	struct decode transcoded = *decode;
+	jvirt_barray_ptr *coefficients;
+	double start = now_ms();
+	bool loaded;
+
+	/* The bands entropy decode their part again, which only pays off with enough
+	 * workers. Scaling down leaves little work besides entropy decoding. */
+	if (workers_count() < 4 || header->scale_denom > 1)
+		return false;
+
+	src.err = dst.err = cinfo.err = jpeg_std_error(&error.mgr);
+	error.mgr.error_exit = error_exit;
+	error.mgr.output_message = output_message;
+	if (setjmp(error.jump)) {
+		log_debug("libjpeg: transcoding failed: %s", error.message);
+		jpeg_destroy_decompress(&cinfo);
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		free(dest.data);
+		return false;
+	}
+	jpeg_create_decompress(&src);
+	jpeg_create_compress(&dst);
+	jpeg_create_decompress(&cinfo);
+
+	jpeg_mem_src(&src, decode->data, decode->size);
+	jpeg_read_header(&src, TRUE);
+	coefficients = jpeg_read_coefficients(&src);
+
+	dest.size = decode->size + 4096;
+	dest.data = malloc(dest.size);
+	if (!dest.data) {
+		strcpy(error.message, "out of memory");
+		longjmp(error.jump, 1);
+	}
+	dest.mgr.init_destination = destination_init;
+	dest.mgr.empty_output_buffer = destination_empty;
+	dest.mgr.term_destination = destination_term;
+	dest.mgr.next_output_byte = dest.data;
+	dest.mgr.free_in_buffer = dest.size;
+	dst.dest = &dest.mgr;
+	jpeg_copy_critical_parameters(&src, &dst);
+	dst.restart_in_rows = 1;
+	jpeg_write_coefficients(&dst, coefficients);
+	jpeg_finish_compress(&dst);
+	jpeg_finish_decompress(&src);
+
+	transcoded.data = dest.data;
+	transcoded.size = dest.size - dest.mgr.free_in_buffer;
+	log_debug("libjpeg: transcoded to restart markers in %.3f ms", now_ms() - start);
+	jpeg_mem_src(&cinfo, transcoded.data, transcoded.size);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_EXT_RGBA;
+	jpeg_calc_output_dimensions(&cinfo);
+	loaded = jpeg_load_bands(&transcoded, &cinfo);
+
+	jpeg_destroy_decompress(&cinfo);
+	jpeg_destroy_compress(&dst);
+	jpeg_destroy_decompress(&src);
+	free(dest.data);
+	if (!loaded)
+		return false;
+	decode->pixels = transcoded.pixels;
+	decode->width = transcoded.width;
+	decode->height = transcoded.height;
+	decode->rows_done = transcoded.rows_done;
+	decode->opaque = transcoded.opaque;
+	return true;
+}
+
+static bool
+jpeg_load(struct decode *decode)
+{
+	/* Outlives the call for decode->error */
+	static struct error error;
+	struct jpeg_decompress_struct cinfo;
+	unsigned char *volatile pixels = NULL;
+	JSAMPROW row;
+
+	/* Leave anything but JPEG to the other decoders */
+	if (decode->size < 3 || decode->data[0] != 0xff || decode->data[1] != 0xd8 ||
+			decode->data[2] != 0xff)
+		return false;
+
+	cinfo.err = jpeg_std_error(&error.mgr);
+	error.mgr.error_exit = error_exit;
+	error.mgr.output_message = output_message;
+	if (setjmp(error.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		buffer_free(pixels);
+		decode->pixels = NULL;
+		decode->error = error.message;
+		return false;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, decode->data, decode->size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	/* The IDCT scales blocks down for free, skipping most of the work of decoding pixels
+	 * that would only be thrown away when scaling */
+	cinfo.out_color_space = JCS_EXT_RGBA;
+	cinfo.scale_num = 1;
+	for (cinfo.scale_denom = 8; cinfo.scale_denom > 1; cinfo.scale_denom /= 2)
+		if ((cinfo.image_width + cinfo.scale_denom - 1) / cinfo.scale_denom >=
+				(unsigned int)decode->min_width &&
+				(cinfo.image_height + cinfo.scale_denom - 1) / cinfo.scale_denom >=
+				(unsigned int)decode->min_height)
+			break;
+	jpeg_calc_output_dimensions(&cinfo);
+	if (cinfo.scale_denom > 1)
+		log_debug("libjpeg: scaling %ux%u image by 1/%u while decoding", cinfo.image_width,
+				cinfo.image_height, cinfo.scale_denom);
+
+	if (jpeg_load_bands(decode, &cinfo) || jpeg_load_transcoded(decode, &cinfo)) {
+		jpeg_destroy_decompress(&cinfo);
+		return true;
+	}
+
+	/* With few workers, or if decoding in bands failed, decode in one go */
+	jpeg_start_decompress(&cinfo);
+	pixels = buffer_alloc((size_t)cinfo.output_width * cinfo.output_height * 4, true);
+	if (!pixels) {
+		jpeg_destroy_decompress(&cinfo);
+		decode->error = "out of memory";
+		return false;
+	}
+	decode->pixels = pixels;
+	decode->width = cinfo.output_width;
+	decode->height = cinfo.output_height;
+	/* Rows are written straight into place and converted while still in cache */
+	while (cinfo.output_scanline < cinfo.output_height) {
+		row = pixels + (size_t)cinfo.output_scanline * cinfo.output_width * 4;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+		decode_rows(decode, cinfo.output_scanline);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return true;
+}
+
+const struct decoder jpeg_decoder = {
+	.name = "libjpeg-turbo",
+	.load = jpeg_load,
+};
+
+#endif /* HAVE_LIBJPEG */
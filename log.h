@@ -0,0 +1,12 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+
+void log_set_verbose(bool verbose);
+void log_debug(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Monotonic timestamp in milliseconds, used for timing reports */
+double now_ms(void);
+
+#endif /* LOG_H */
@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mipmap.h"
+
+/* Averages four pixels per channel with rounding, two channels at a time */
+static inline uint32_t
+average(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	uint32_t rb = (a & 0xff00ff) + (b & 0xff00ff) + (c & 0xff00ff) + (d & 0xff00ff);
+	uint32_t ag = (a >> 8 & 0xff00ff) + (b >> 8 & 0xff00ff) + (c >> 8 & 0xff00ff) +
+		(d >> 8 & 0xff00ff);
+
+	rb = (rb + 0x20002) >> 2 & 0xff00ff;
+	ag = (ag + 0x20002) >> 2 & 0xff00ff;
+	return ag << 8 | rb;
+}
+
+/* Odd sizes round up, with the last row or column averaged with itself */
+static void
+halve(const struct mipmap_level *src, struct mipmap_level *dst)
+{
+	for (int y = 0; y < dst->height; y++) {
+		const uint32_t *row0 = src->pixels + (size_t)2 * y * src->width;
+		const uint32_t *row1 = 2 * y + 1 < src->height ? row0 + src->width : row0;
+		uint32_t *out = dst->pixels + (size_t)y * dst->width;
+		int x;
+
+		for (x = 0; 2 * x + 1 < src->width; x++)
+			out[x] = average(row0[2 * x], row0[2 * x + 1], row1[2 * x], row1[2 * x + 1]);
+		if (x < dst->width)
+			out[x] = average(row0[2 * x], row0[2 * x], row1[2 * x], row1[2 * x]);
+	}
+}
+
+int
+mipmap_build(struct mipmap_level *levels)
+{
+	int count = 1;
+
+	while (count < MIPMAP_MAX_LEVELS &&
+			(levels[count - 1].width > 1 || levels[count - 1].height > 1)) {
+		const struct mipmap_level *src = &levels[count - 1];
+		struct mipmap_level *dst = &levels[count];
+
+		dst->width = (src->width + 1) / 2;
+		dst->height = (src->height + 1) / 2;
+		dst->pixels = malloc((size_t)dst->width * dst->height * 4);
+		if (!dst->pixels)
+			break;
+		halve(src, dst);
+		count++;
+	}
+	return count;
+}
+
+void
+mipmap_finish(struct mipmap_level *levels, int count)
+{
+	for (int i = 1; i < count; i++)
+		free(levels[i].pixels);
+}
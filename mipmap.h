@@ -0,0 +1,20 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <stdint.h>
+
+#define MIPMAP_MAX_LEVELS 16
+
+/* One level of an image pyramid of premultiplied 32-bit pixels, rows packed */
+struct mipmap_level {
+	uint32_t *pixels;
+	int width, height;
+};
+
+/* Fills levels[1] onwards by repeatedly halving levels[0] with a box filter, down to a
+ * single pixel. Returns the number of levels, including the first. */
+int mipmap_build(struct mipmap_level *levels);
+/* Frees every level except the first, which belongs to the caller */
+void mipmap_finish(struct mipmap_level *levels, int count);
+
+#endif /* MIPMAP_H */
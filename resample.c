@@ -0,0 +1,555 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resample.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Weights are fixed point with this many fractional bits, which keeps every product and
+ * sum of 8-bit channels within 32 bits */
+#define WEIGHT_BITS 14
+
+/* Per output coordinate, the first source pixel and taps weights, zero padded so every
+ * output uses the same number of taps */
+struct coeffs {
+	int *start;
+	int16_t *weights;
+	int taps;
+};
+
+typedef void (*hpass_func)(const uint32_t *row, const struct coeffs *c, uint32_t *out,
+		int width);
+/* Vertical passes write out[x] up to out[width - 1], starting at x */
+typedef void (*vpass_func)(const uint32_t *const *rows, const int16_t *weights, int taps,
+		uint32_t *out, int x, int width);
+
+struct resample_plan {
+	struct coeffs h, v;
+	int dst_width, dst_height;
+	hpass_func hpass;
+	vpass_func vpass;
+};
+
+static double
+bilinear(double x)
+{
+	x = fabs(x);
+	return x < 1 ? 1 - x : 0;
+}
+
+/* Mitchell-Netravali with B = C = 1/3 */
+static double
+mitchell(double x)
+{
+	const double b = 1. / 3, c = 1. / 3;
+
+	x = fabs(x);
+	if (x < 1)
+		return ((12 - 9 * b - 6 * c) * x * x * x + (-18 + 12 * b + 6 * c) * x * x +
+				(6 - 2 * b)) / 6;
+	if (x < 2)
+		return ((-b - 6 * c) * x * x * x + (6 * b + 30 * c) * x * x +
+				(-12 * b - 48 * c) * x + (8 * b + 24 * c)) / 6;
+	return 0;
+}
+
+static double
+sinc(double x)
+{
+	const double pi = 3.14159265358979323846;
+
+	return x == 0 ? 1 : sin(pi * x) / (pi * x);
+}
+
+static double
+lanczos3(double x)
+{
+	return fabs(x) < 3 ? sinc(x) * sinc(x / 3) : 0;
+}
+
+static const struct {
+	double (*func)(double x);
+	double support;
+} filters[] = {
+	[FilterBilinear] = {bilinear, 1},
+	[FilterMitchell] = {mitchell, 2},
+	[FilterLanczos3] = {lanczos3, 3},
+};
+
+static bool
+coeffs_init(struct coeffs *c, int filter, int src_size, double offset, double length,
+		int dst_size, int align)
+{
+	const double scale = length / dst_size, fscale = fmax(scale, 1);
+	const double support = filters[filter].support * fscale;
+	double *w;
+	int taps = 2 * (int)ceil(support) + 1;
+
+	/* Padding lets the vector kernels work in whole groups of taps */
+	taps = (taps + align - 1) / align * align;
+	if (taps > src_size)
+		taps = src_size;
+
+	c->taps = taps;
+	c->start = malloc(dst_size * sizeof *c->start);
+	c->weights = malloc((size_t)dst_size * taps * sizeof *c->weights);
+	w = malloc(taps * sizeof *w);
+	if (!c->start || !c->weights || !w) {
+		free(w);
+		return false;
+	}
+
+	for (int i = 0; i < dst_size; i++) {
+		const double center = offset + (i + 0.5) * scale;
+		int start = floor(center - support), sum_fixed = 0, largest = 0;
+		double sum = 0;
+
+		/* Keep the window inside the image, the weights outside of it are lost and
+		 * the rest renormalized */
+		if (start > src_size - taps)
+			start = src_size - taps;
+		if (start < 0)
+			start = 0;
+		c->start[i] = start;
+
+		for (int j = 0; j < taps; j++) {
+			w[j] = filters[filter].func((start + j + 0.5 - center) / fscale);
+			sum += w[j];
+		}
+		for (int j = 0; j < taps; j++) {
+			int16_t *weight = &c->weights[(size_t)i * taps + j];
+
+			*weight = sum != 0 ? lround(w[j] / sum * (1 << WEIGHT_BITS)) : 0;
+			sum_fixed += *weight;
+			if (*weight > c->weights[(size_t)i * taps + largest])
+				largest = j;
+		}
+		/* Rounding must not change the overall brightness */
+		c->weights[(size_t)i * taps + largest] += (1 << WEIGHT_BITS) - sum_fixed;
+	}
+
+	free(w);
+	return true;
+}
+
+static void
+coeffs_finish(struct coeffs *c)
+{
+	free(c->start);
+	free(c->weights);
+}
+
+static inline int
+clamp_channel(int32_t v)
+{
+	v = (v + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Negative lobes can leave colour above alpha, which is invalid when premultiplied */
+static inline uint32_t
+pack(int32_t b, int32_t g, int32_t r, int32_t a)
+{
+	const int ca = clamp_channel(a);
+	int cr = clamp_channel(r), cg = clamp_channel(g), cb = clamp_channel(b);
+
+	cr = cr > ca ? ca : cr;
+	cg = cg > ca ? ca : cg;
+	cb = cb > ca ? ca : cb;
+	return (uint32_t)ca << 24 | cr << 16 | cg << 8 | cb;
+}
+
+static void
+hpass_scalar(const uint32_t *row, const struct coeffs *c, uint32_t *out, int width)
+{
+	for (int x = 0; x < width; x++) {
+		const uint32_t *p = row + c->start[x];
+		const int16_t *w = c->weights + (size_t)x * c->taps;
+		int32_t b = 0, g = 0, r = 0, a = 0;
+
+		for (int t = 0; t < c->taps; t++) {
+			b += (int32_t)(p[t] & 0xff) * w[t];
+			g += (int32_t)(p[t] >> 8 & 0xff) * w[t];
+			r += (int32_t)(p[t] >> 16 & 0xff) * w[t];
+			a += (int32_t)(p[t] >> 24) * w[t];
+		}
+		out[x] = pack(b, g, r, a);
+	}
+}
+
+static void
+vpass_scalar(const uint32_t *const *rows, const int16_t *w, int taps, uint32_t *out, int x,
+		int width)
+{
+	for (; x < width; x++) {
+		int32_t b = 0, g = 0, r = 0, a = 0;
+
+		for (int t = 0; t < taps; t++) {
+			const uint32_t p = rows[t][x];
+			b += (int32_t)(p & 0xff) * w[t];
+			g += (int32_t)(p >> 8 & 0xff) * w[t];
+			r += (int32_t)(p >> 16 & 0xff) * w[t];
+			a += (int32_t)(p >> 24) * w[t];
+		}
+		out[x] = pack(b, g, r, a);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+/* The vector kernels interleave two taps per 32-bit lane, so that madd multiplies both by
+ * their weight and sums them in one go. Results are rounded, saturated to 8 bits and
+ * clamped to alpha exactly like pack(). */
+
+static inline int32_t
+weight_pair(const int16_t *w)
+{
+	int32_t pair;
+	memcpy(&pair, w, sizeof pair);
+	return pair;
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+clamp_premultiplied_sse2(__m128i v)
+{
+	__m128i a = _mm_srli_epi32(v, 24);
+
+	a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+	a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+	return _mm_min_epu8(v, a);
+}
+
+__attribute__((target("sse2"))) static inline __m128i
+round_sse2(__m128i acc)
+{
+	return _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(1 << (WEIGHT_BITS - 1))),
+			WEIGHT_BITS);
+}
+
+/* Adds taps from first onwards, two and then one at a time, to the b, g, r, a sums */
+__attribute__((target("sse2"))) static inline __m128i
+htaps_sse2(__m128i acc, const uint32_t *p, const int16_t *w, int first, int taps)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int t;
+
+	for (t = first; t + 2 <= taps; t += 2) {
+		__m128i px = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + t)), zero);
+		px = _mm_unpacklo_epi16(px, _mm_srli_si128(px, 8));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weight_pair(w + t))));
+	}
+	if (t < taps) {
+		__m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(p[t]), zero);
+		px = _mm_unpacklo_epi16(px, zero);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32((uint16_t)w[t])));
+	}
+	return acc;
+}
+
+__attribute__((target("sse2"))) static inline uint32_t
+hpack_sse2(__m128i acc)
+{
+	acc = round_sse2(acc);
+	acc = _mm_packs_epi32(acc, acc);
+	return _mm_cvtsi128_si32(clamp_premultiplied_sse2(_mm_packus_epi16(acc, acc)));
+}
+
+__attribute__((target("sse2"))) static void
+hpass_sse2(const uint32_t *row, const struct coeffs *c, uint32_t *out, int width)
+{
+	for (int x = 0; x < width; x++)
+		out[x] = hpack_sse2(htaps_sse2(_mm_setzero_si128(), row + c->start[x],
+				c->weights + (size_t)x * c->taps, 0, c->taps));
+}
+
+__attribute__((target("avx2"))) static void
+hpass_avx2(const uint32_t *row, const struct coeffs *c, uint32_t *out, int width)
+{
+	/* Within each lane, interleaves the channels of two pixels */
+	const __m256i interleave = _mm256_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7,
+			14, 15, 0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+
+	for (int x = 0; x < width; x++) {
+		const uint32_t *p = row + c->start[x];
+		const int16_t *w = c->weights + (size_t)x * c->taps;
+		__m256i acc = _mm256_setzero_si256();
+		__m128i sum;
+		int t;
+
+		for (t = 0; t + 4 <= c->taps; t += 4) {
+			__m256i px = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p + t)));
+			__m256i wv = _mm256_inserti128_si256(_mm256_castsi128_si256(
+					_mm_set1_epi32(weight_pair(w + t))),
+					_mm_set1_epi32(weight_pair(w + t + 2)), 1);
+			px = _mm256_shuffle_epi8(px, interleave);
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(px, wv));
+		}
+		sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		out[x] = hpack_sse2(htaps_sse2(sum, p, w, t, c->taps));
+	}
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+hpass_avx512(const uint32_t *row, const struct coeffs *c, uint32_t *out, int width)
+{
+	const __m512i interleave = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11,
+			4, 5, 12, 13, 6, 7, 14, 15));
+	/* Gives lane n the weight pair for taps 2n and 2n + 1 */
+	const __m512i spread = _mm512_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3);
+
+	for (int x = 0; x < width; x++) {
+		const uint32_t *p = row + c->start[x];
+		const int16_t *w = c->weights + (size_t)x * c->taps;
+		__m512i acc = _mm512_setzero_si512();
+		__m256i half;
+		__m128i sum;
+		int t;
+
+		for (t = 0; t + 8 <= c->taps; t += 8) {
+			__m512i px = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(p + t)));
+			__m512i wv = _mm512_permutexvar_epi32(spread, _mm512_castsi128_si512(
+					_mm_loadu_si128((const __m128i *)(w + t))));
+			px = _mm512_shuffle_epi8(px, interleave);
+			acc = _mm512_add_epi32(acc, _mm512_madd_epi16(px, wv));
+		}
+		half = _mm256_add_epi32(_mm512_castsi512_si256(acc), _mm512_extracti64x4_epi64(acc, 1));
+		sum = _mm_add_epi32(_mm256_castsi256_si128(half), _mm256_extracti128_si256(half, 1));
+		out[x] = hpack_sse2(htaps_sse2(sum, p, w, t, c->taps));
+	}
+}
+
+__attribute__((target("sse2"))) static void
+vpass_sse2(const uint32_t *const *rows, const int16_t *w, int taps, uint32_t *out, int x,
+		int width)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; x + 4 <= width; x += 4) {
+		__m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero, lo, hi;
+
+		for (int t = 0; t < taps; t += 2) {
+			const __m128i a = _mm_loadu_si128((const __m128i *)(rows[t] + x));
+			const __m128i b = t + 1 < taps ?
+				_mm_loadu_si128((const __m128i *)(rows[t + 1] + x)) : zero;
+			const __m128i wv = _mm_set1_epi32(t + 1 < taps ?
+					weight_pair(w + t) : (uint16_t)w[t]);
+			const __m128i alo = _mm_unpacklo_epi8(a, zero), blo = _mm_unpacklo_epi8(b, zero);
+			const __m128i ahi = _mm_unpackhi_epi8(a, zero), bhi = _mm_unpackhi_epi8(b, zero);
+
+			acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(alo, blo), wv));
+			acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(alo, blo), wv));
+			acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(ahi, bhi), wv));
+			acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(ahi, bhi), wv));
+		}
+		lo = _mm_packs_epi32(round_sse2(acc0), round_sse2(acc1));
+		hi = _mm_packs_epi32(round_sse2(acc2), round_sse2(acc3));
+		_mm_storeu_si128((__m128i *)(out + x),
+				clamp_premultiplied_sse2(_mm_packus_epi16(lo, hi)));
+	}
+	vpass_scalar(rows, w, taps, out, x, width);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+round_avx2(__m256i acc)
+{
+	return _mm256_srai_epi32(_mm256_add_epi32(acc,
+			_mm256_set1_epi32(1 << (WEIGHT_BITS - 1))), WEIGHT_BITS);
+}
+
+__attribute__((target("avx2"))) static void
+vpass_avx2(const uint32_t *const *rows, const int16_t *w, int taps, uint32_t *out, int x,
+		int width)
+{
+	const __m256i zero = _mm256_setzero_si256();
+
+	/* Unpacking and packing stay within 128-bit lanes, so pixel order is kept */
+	for (; x + 8 <= width; x += 8) {
+		__m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero, lo, hi, v, a8;
+
+		for (int t = 0; t < taps; t += 2) {
+			const __m256i a = _mm256_loadu_si256((const __m256i *)(rows[t] + x));
+			const __m256i b = t + 1 < taps ?
+				_mm256_loadu_si256((const __m256i *)(rows[t + 1] + x)) : zero;
+			const __m256i wv = _mm256_set1_epi32(t + 1 < taps ?
+					weight_pair(w + t) : (uint16_t)w[t]);
+			const __m256i alo = _mm256_unpacklo_epi8(a, zero);
+			const __m256i blo = _mm256_unpacklo_epi8(b, zero);
+			const __m256i ahi = _mm256_unpackhi_epi8(a, zero);
+			const __m256i bhi = _mm256_unpackhi_epi8(b, zero);
+
+			acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(alo, blo), wv));
+			acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(alo, blo), wv));
+			acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(ahi, bhi), wv));
+			acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(ahi, bhi), wv));
+		}
+		lo = _mm256_packs_epi32(round_avx2(acc0), round_avx2(acc1));
+		hi = _mm256_packs_epi32(round_avx2(acc2), round_avx2(acc3));
+		v = _mm256_packus_epi16(lo, hi);
+		a8 = _mm256_srli_epi32(v, 24);
+		a8 = _mm256_or_si256(a8, _mm256_slli_epi32(a8, 8));
+		a8 = _mm256_or_si256(a8, _mm256_slli_epi32(a8, 16));
+		_mm256_storeu_si256((__m256i *)(out + x), _mm256_min_epu8(v, a8));
+	}
+	vpass_sse2(rows, w, taps, out, x, width);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i
+round_avx512(__m512i acc)
+{
+	return _mm512_srai_epi32(_mm512_add_epi32(acc,
+			_mm512_set1_epi32(1 << (WEIGHT_BITS - 1))), WEIGHT_BITS);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+vpass_avx512(const uint32_t *const *rows, const int16_t *w, int taps, uint32_t *out,
+		int x, int width)
+{
+	const __m512i zero = _mm512_setzero_si512();
+
+	for (; x + 16 <= width; x += 16) {
+		__m512i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero, lo, hi, v, a8;
+
+		for (int t = 0; t < taps; t += 2) {
+			const __m512i a = _mm512_loadu_si512(rows[t] + x);
+			const __m512i b = t + 1 < taps ? _mm512_loadu_si512(rows[t + 1] + x) : zero;
+			const __m512i wv = _mm512_set1_epi32(t + 1 < taps ?
+					weight_pair(w + t) : (uint16_t)w[t]);
+			const __m512i alo = _mm512_unpacklo_epi8(a, zero);
+			const __m512i blo = _mm512_unpacklo_epi8(b, zero);
+			const __m512i ahi = _mm512_unpackhi_epi8(a, zero);
+			const __m512i bhi = _mm512_unpackhi_epi8(b, zero);
+
+			acc0 = _mm512_add_epi32(acc0, _mm512_madd_epi16(_mm512_unpacklo_epi16(alo, blo), wv));
+			acc1 = _mm512_add_epi32(acc1, _mm512_madd_epi16(_mm512_unpackhi_epi16(alo, blo), wv));
+			acc2 = _mm512_add_epi32(acc2, _mm512_madd_epi16(_mm512_unpacklo_epi16(ahi, bhi), wv));
+			acc3 = _mm512_add_epi32(acc3, _mm512_madd_epi16(_mm512_unpackhi_epi16(ahi, bhi), wv));
+		}
+		lo = _mm512_packs_epi32(round_avx512(acc0), round_avx512(acc1));
+		hi = _mm512_packs_epi32(round_avx512(acc2), round_avx512(acc3));
+		v = _mm512_packus_epi16(lo, hi);
+		a8 = _mm512_srli_epi32(v, 24);
+		a8 = _mm512_or_si512(a8, _mm512_slli_epi32(a8, 8));
+		a8 = _mm512_or_si512(a8, _mm512_slli_epi32(a8, 16));
+		_mm512_storeu_si512(out + x, _mm512_min_epu8(v, a8));
+	}
+	vpass_avx2(rows, w, taps, out, x, width);
+}
+#endif
+
+static const char *isa = "scalar";
+static hpass_func hpass = hpass_scalar;
+static vpass_func vpass = vpass_scalar;
+static int tap_align = 1;
+
+static void
+choose_kernels(void)
+{
+	static bool chosen = false;
+
+	if (chosen)
+		return;
+	chosen = true;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+		isa = "avx512";
+		hpass = hpass_avx512;
+		vpass = vpass_avx512;
+		tap_align = 8;
+	} else if (__builtin_cpu_supports("avx2")) {
+		isa = "avx2";
+		hpass = hpass_avx2;
+		vpass = vpass_avx2;
+		tap_align = 4;
+	} else if (__builtin_cpu_supports("sse2")) {
+		isa = "sse2";
+		hpass = hpass_sse2;
+		vpass = vpass_sse2;
+		tap_align = 2;
+	}
+#endif
+}
+
+const char *
+resample_isa(void)
+{
+	choose_kernels();
+	return isa;
+}
+
+struct resample_plan *
+resample_plan_create(int filter, int image_width, int image_height,
+		double src_x, double src_y, double src_width, double src_height,
+		int dst_width, int dst_height)
+{
+	struct resample_plan *plan;
+
+	if (filter == FilterPixman || dst_width <= 0 || dst_height <= 0)
+		return NULL;
+
+	choose_kernels();
+	plan = calloc(1, sizeof *plan);
+	if (!plan)
+		return NULL;
+	plan->dst_width = dst_width;
+	plan->dst_height = dst_height;
+	plan->hpass = hpass;
+	plan->vpass = vpass;
+	if (!coeffs_init(&plan->h, filter, image_width, src_x, src_width, dst_width, tap_align) ||
+			!coeffs_init(&plan->v, filter, image_height, src_y, src_height, dst_height, 2)) {
+		resample_plan_destroy(plan);
+		return NULL;
+	}
+	return plan;
+}
+
+bool
+resample_rows(const struct resample_plan *plan, const uint32_t *src, int src_stride,
+		uint32_t *dst, int dst_stride, int y0, int y1)
+{
+	const int taps = plan->v.taps, width = plan->dst_width;
+	/* Horizontally scaled source rows, kept in a ring indexed by source row. Windows
+	 * only move down, so the rows of one output row never overwrite each other. */
+	uint32_t *ring = malloc((size_t)taps * width * sizeof *ring);
+	const uint32_t **rows = malloc(taps * sizeof *rows);
+	int next = 0;
+
+	if (!ring || !rows) {
+		free(ring);
+		free(rows);
+		return false;
+	}
+
+	for (int y = y0; y < y1; y++) {
+		const int start = plan->v.start[y];
+
+		for (int r = next > start ? next : start; r < start + taps; r++)
+			plan->hpass(src + (size_t)r * src_stride, &plan->h,
+					ring + (size_t)(r % taps) * width, width);
+		next = start + taps;
+
+		for (int t = 0; t < taps; t++)
+			rows[t] = ring + (size_t)((start + t) % taps) * width;
+		plan->vpass(rows, plan->v.weights + (size_t)y * taps, taps,
+				dst + (size_t)y * dst_stride, 0, width);
+	}
+
+	free(ring);
+	free(rows);
+	return true;
+}
+
+void
+resample_plan_destroy(struct resample_plan *plan)
+{
+	if (!plan)
+		return;
+	coeffs_finish(&plan->h);
+	coeffs_finish(&plan->v);
+	free(plan);
+}
@@ -0,0 +1,28 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Resampling filter. FilterPixman leaves scaling to pixman's transformed composite. */
+enum { FilterPixman, FilterBilinear, FilterMitchell, FilterLanczos3 };
+
+struct resample_plan;
+
+/* Prepares scaling the src_width x src_height rectangle at (src_x, src_y) of an image of
+ * image_width x image_height premultiplied 32-bit pixels to dst_width x dst_height. Pixels
+ * outside of the rectangle but inside the image contribute to the edges. Returns NULL if
+ * the filter is not handled here or on allocation failure. */
+struct resample_plan *resample_plan_create(int filter, int image_width, int image_height,
+		double src_x, double src_y, double src_width, double src_height,
+		int dst_width, int dst_height);
+/* Writes rows y0 up to y1 of the scaled image, rows of which are independent of each
+ * other. Strides are in pixels. Returns false on allocation failure. */
+bool resample_rows(const struct resample_plan *plan, const uint32_t *src, int src_stride,
+		uint32_t *dst, int dst_stride, int y0, int y1);
+void resample_plan_destroy(struct resample_plan *plan);
+
+/* Name of the instruction set the kernels were chosen for */
+const char *resample_isa(void);
+
+#endif /* RESAMPLE_H */
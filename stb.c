@@ -0,0 +1,54 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "decode.h"
+
+/* Size of the image being decoded. stb allocates the pixels it returns with this size or
+ * one byte more, and these are decoded into memory that can become a wl_buffer without
+ * being copied. */
+static size_t image_size;
+#define IS_IMAGE_SIZE(size) (image_size && (size) - image_size <= 1)
+
+#define STBI_ONLY_JPEG
+#define STBI_ONLY_PNG
+#define STBI_MALLOC(size) buffer_alloc(size, IS_IMAGE_SIZE(size))
+#define STBI_REALLOC(data, size) buffer_realloc(data, size, IS_IMAGE_SIZE(size))
+#define STBI_FREE(data) buffer_free(data)
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+static bool
+stb_info(const unsigned char *data, size_t size, int *width, int *height)
+{
+	return size <= INT_MAX && stbi_info_from_memory(data, size, width, height, NULL);
+}
+
+static bool
+stb_load(struct decode *decode)
+{
+	int width, height;
+
+	if (decode->size > INT_MAX) {
+		decode->error = "image file too large";
+		return false;
+	}
+	if (stbi_info_from_memory(decode->data, decode->size, &width, &height, NULL))
+		image_size = (size_t)width * height * 4;
+	decode->pixels = stbi_load_from_memory(decode->data, decode->size, &decode->width,
+			&decode->height, NULL, 4);
+	image_size = 0;
+	if (!decode->pixels) {
+		decode->error = stbi_failure_reason();
+		return false;
+	}
+	return true;
+}
+
+const struct decoder stb_decoder = {
+	.name = "stb_image",
+	.info = stb_info,
+	.load = stb_load,
+};
@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "workers.h"
+
+/* The indices of one workers_run() call or submission */
+struct batch {
+	void (*func)(void *data, int index);
+	void *data;
+	int count, claimed, done;
+	bool submitted;
+	/* Next in the queue while indices are left to claim, then in the completed list */
+	struct batch *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Broadcast when a batch is queued or completes */
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+/* Batches that still have unclaimed indices, oldest first */
+static struct batch *queue;
+/* Completed submissions not yet collected, oldest first */
+static struct batch *completed, **completed_tail = &completed;
+static int notify_fds[2] = {-1, -1};
+static pthread_t *threads;
+static int thread_count;
+static bool stopping = false;
+
+/* Takes the next index of batch, which must have one left. Called with lock held. */
+static int
+claim(struct batch *batch)
+{
+	struct batch **link;
+	const int index = batch->claimed++;
+
+	if (batch->claimed == batch->count) {
+		for (link = &queue; *link != batch; link = &(*link)->next)
+			;
+		*link = batch->next;
+	}
+	return index;
+}
+
+/* Called with lock held */
+static void
+complete(struct batch *batch)
+{
+	if (batch->submitted) {
+		batch->next = NULL;
+		*completed_tail = batch;
+		completed_tail = &batch->next;
+		/* A full pipe already wakes the collector, so EAGAIN needs no handling */
+		if (write(notify_fds[1], "", 1) == -1 && errno != EAGAIN)
+			fprintf(stderr, "jab: failed to notify about a drawn frame\n");
+	}
+	pthread_cond_broadcast(&changed);
+}
+
+/* Runs an index claimed from batch. Called with lock held, which is dropped meanwhile. */
+static void
+execute(struct batch *batch, int index)
+{
+	pthread_mutex_unlock(&lock);
+	batch->func(batch->data, index);
+	pthread_mutex_lock(&lock);
+	if (++batch->done == batch->count)
+		complete(batch);
+}
+
+/* Called with lock held */
+static void
+enqueue(struct batch *batch)
+{
+	struct batch **link;
+
+	for (link = &queue; *link; link = &(*link)->next)
+		;
+	*link = batch;
+	pthread_cond_broadcast(&changed);
+}
+
+static void *
+worker(void *data)
+{
+	struct batch *batch;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!queue && !stopping)
+			pthread_cond_wait(&changed, &lock);
+		/* Finish what was queued before stopping */
+		if (!queue)
+			break;
+		batch = queue;
+		execute(batch, claim(batch));
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+bool
+workers_init(int count)
+{
+	if (pipe(notify_fds) == -1)
+		return false;
+	for (int i = 0; i < 2; i++) {
+		fcntl(notify_fds[i], F_SETFD, FD_CLOEXEC);
+		fcntl(notify_fds[i], F_SETFL, O_NONBLOCK);
+	}
+
+	threads = calloc(count > 1 ? count - 1 : 1, sizeof *threads);
+	if (!threads)
+		return false;
+
+	for (thread_count = 0; thread_count < count - 1; thread_count++)
+		if (pthread_create(&threads[thread_count], NULL, worker, NULL) != 0) {
+			fprintf(stderr, "jab: failed to start worker thread\n");
+			break;
+		}
+	return true;
+}
+
+void
+workers_run(void (*func)(void *data, int index), void *data, int count)
+{
+	struct batch batch = {func, data, count, 0, 0, false, NULL};
+
+	/* An empty batch would never be claimed in full and stay queued */
+	if (count <= 0)
+		return;
+	if (thread_count == 0 || count == 1) {
+		for (int i = 0; i < count; i++)
+			func(data, i);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	enqueue(&batch);
+
+	/* Help out instead of just waiting, which also keeps nested calls from waiting on
+	 * indices that no thread is free to run */
+	while (batch.claimed < batch.count)
+		execute(&batch, claim(&batch));
+	while (batch.done < batch.count)
+		pthread_cond_wait(&changed, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+bool
+workers_submit(void (*func)(void *data, int index), void *data)
+{
+	struct batch *batch = calloc(1, sizeof *batch);
+
+	if (!batch)
+		return false;
+	*batch = (struct batch){func, data, 1, 0, 0, true, NULL};
+
+	pthread_mutex_lock(&lock);
+	if (thread_count == 0) {
+		batch->claimed = 1;
+		execute(batch, 0);
+	} else
+		enqueue(batch);
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+int
+workers_fd(void)
+{
+	return notify_fds[0];
+}
+
+void *
+workers_collect(void)
+{
+	struct batch *batch;
+	void *data = NULL;
+	char buf[64];
+
+	/* Drain first, so that completions after this wake the collector again */
+	while (read(notify_fds[0], buf, sizeof buf) > 0 || errno == EINTR)
+		;
+
+	pthread_mutex_lock(&lock);
+	batch = completed;
+	if (batch) {
+		completed = batch->next;
+		if (!completed)
+			completed_tail = &completed;
+		data = batch->data;
+	}
+	pthread_mutex_unlock(&lock);
+	free(batch);
+	return data;
+}
+
+int
+workers_count(void)
+{
+	return thread_count + 1;
+}
+
+void
+workers_finish(void)
+{
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	threads = NULL;
+	thread_count = 0;
+
+	for (int i = 0; i < 2; i++) {
+		if (notify_fds[i] != -1)
+			close(notify_fds[i]);
+		notify_fds[i] = -1;
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdbool.h>
+
+/* Starts count - 1 worker threads, the calling thread making up the last one */
+bool workers_init(int count);
+/* Calls func(data, index) for every index from 0 up to count - 1, spread across the
+ * workers and the calling thread, and returns once all calls have. May be called from
+ * within func. Does nothing if count is not positive. */
+void workers_run(void (*func)(void *data, int index), void *data, int count);
+/* Queues func(data, 0) to run on a worker and returns right away, or runs it right away
+ * without workers. Once it has returned, data is handed back by workers_collect(). */
+bool workers_submit(void (*func)(void *data, int index), void *data);
+/* Descriptor that becomes readable when a submission completes */
+int workers_fd(void);
+/* Returns the data of the oldest completed submission, or NULL if there is none. Call
+ * until it returns NULL whenever workers_fd() becomes readable. */
+void *workers_collect(void);
+/* Number of threads work is spread across, including the calling one */
+int workers_count(void);
+/* Stops the workers after they have run everything queued. Completed submissions can
+ * still be collected afterwards. */
+void workers_finish(void);
+
+#endif /* WORKERS_H */